@@ -0,0 +1,93 @@
+#if defined(BOOTCACHE)
+/* A token in the BootOpt sector, right after struct bootopt_t, telling
+ * that the app BootOpt describes has been verified already on this device.
+ * It is a MAC over BootOpt keyed by the AES key and the device UID, so it
+ * can neither be forged nor copied over from another device, and checking
+ * it costs the same whatever the size of the app is.
+ *
+ * Whatever writes the app region must call bootcache_invalidate() first.
+ * The token is invalidated by programming it to all zeros, which flash
+ * allows without erasing, and a new BootOpt always comes with the sector
+ * erased. */
+
+#include "bootcache.h"
+#include "bsp.h"
+#include "flash.h"
+#include "tinycrypt/hmac.h"
+#include "tinycrypt/aes.h"
+#include "tinycrypt/utils.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+static inline const uint8_t *get_token(const struct bootopt_t *bootopt)
+{
+	return (const uint8_t *)bootopt + BOOTOPT_TOKEN_OFFSET;
+}
+
+static void compute_token(uint8_t *mac, const struct bootopt_t *bootopt,
+		const void *aeskey)
+{
+	struct tc_hmac_state_struct hmac;
+	uint8_t key[TC_AES_KEY_SIZE + UID_SIZE];
+
+	memcpy(key, aeskey, TC_AES_KEY_SIZE);
+	memcpy(&key[TC_AES_KEY_SIZE], (const void *)UID_BASE, UID_SIZE);
+
+	tc_hmac_set_key(&hmac, key, sizeof(key));
+	tc_hmac_init(&hmac);
+	tc_hmac_update(&hmac, bootopt, sizeof(*bootopt));
+	tc_hmac_final(mac, BOOTOPT_TOKEN_SIZE, &hmac);
+
+	_set(key, 0, sizeof(key));
+	_set(&hmac, 0, sizeof(hmac));
+}
+
+static inline bool is_erased(const uint8_t *p, size_t len)
+{
+	while (len--)
+		if (*p++ != 0xff)
+			return false;
+
+	return true;
+}
+
+int bootcache_valid(const struct bootopt_t *bootopt, const void *aeskey)
+{
+	uint8_t mac[BOOTOPT_TOKEN_SIZE];
+	int res;
+
+	compute_token(mac, bootopt, aeskey);
+	res = !_compare(mac, get_token(bootopt), sizeof(mac));
+	_set(mac, 0, sizeof(mac));
+
+	return res;
+}
+
+void bootcache_save(const struct bootopt_t *bootopt, const void *aeskey)
+{
+	unsigned int buf[(BOOTOPT_TOKEN_OFFSET + BOOTOPT_TOKEN_SIZE) / 4];
+	uint8_t *mac = (uint8_t *)buf + BOOTOPT_TOKEN_OFFSET;
+
+	compute_token(mac, bootopt, aeskey);
+
+	if (is_erased(get_token(bootopt), BOOTOPT_TOKEN_SIZE)) {
+		flash_program((void *)get_token(bootopt), mac,
+				BOOTOPT_TOKEN_SIZE);
+		return;
+	}
+
+	/* A stale token can only go away with the sector erased, so write
+	 * it over again from the beginning of the sector together with
+	 * BootOpt */
+	memcpy(buf, bootopt, BOOTOPT_TOKEN_OFFSET);
+	flash_program((void *)bootopt, buf, sizeof(buf));
+}
+
+void bootcache_invalidate(const struct bootopt_t *bootopt)
+{
+	const unsigned int zero[BOOTOPT_TOKEN_SIZE / 4] = { 0, };
+
+	flash_program((void *)get_token(bootopt), zero, sizeof(zero));
+}
+#endif /* BOOTCACHE */
@@ -0,0 +1,32 @@
+#ifndef __BOOTCACHE_H__
+#define __BOOTCACHE_H__
+
+#include "image.h"
+
+#if defined(BOOTCACHE)
+int bootcache_valid(const struct bootopt_t *bootopt, const void *aeskey);
+void bootcache_save(const struct bootopt_t *bootopt, const void *aeskey);
+void bootcache_invalidate(const struct bootopt_t *bootopt);
+#else
+static inline int bootcache_valid(const struct bootopt_t *bootopt,
+		const void *aeskey)
+{
+	(void)bootopt;
+	(void)aeskey;
+	return 0;
+}
+
+static inline void bootcache_save(const struct bootopt_t *bootopt,
+		const void *aeskey)
+{
+	(void)bootopt;
+	(void)aeskey;
+}
+
+static inline void bootcache_invalidate(const struct bootopt_t *bootopt)
+{
+	(void)bootopt;
+}
+#endif
+
+#endif /* __BOOTCACHE_H__ */
@@ -3,6 +3,7 @@
 
 #include "regs.h"
 
+#if !defined(HOST)
 #define sei()								\
 	__asm__ __volatile__(						\
 			"cpsie i	\n\t"				\
@@ -10,6 +11,20 @@
 			::: "cc", "memory")
 #define cli()								\
 	__asm__ __volatile__("cpsid i" ::: "cc", "memory")
+/* cli() returning PRIMASK as it was, for irq_restore() to put back */
+#define irq_save()		({					\
+	unsigned int _primask;						\
+	__asm__ __volatile__(						\
+			"mrs %0, primask	\n\t"			\
+			"cpsid i		\n\t"			\
+			: "=r"(_primask) :: "cc", "memory");		\
+	_primask;							\
+})
+#define irq_restore(primask)						\
+	__asm__ __volatile__(						\
+			"msr primask, %0	\n\t"			\
+			"isb			\n\t"			\
+			:: "r"(primask) : "cc", "memory")
 
 #define dmb()			__asm__ __volatile__("dmb" ::: "memory")
 #define dsb()			__asm__ __volatile__("dsb" ::: "memory")
@@ -17,6 +32,7 @@
 
 #define setsp(sp)							\
 	__asm__ __volatile__("mov sp, %0" :: "r"(sp))
+#endif
 
 #define debug(msg...)
 
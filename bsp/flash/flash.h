@@ -5,6 +5,13 @@
 #define FLASH_UNLOCK_KEY2			0xCDEF89AB
 
 #define FLASH_MASS_ERASE			0xFFFFFFFFUL
+#define FLASH_IRQ				4 /* EOP and errors */
+
+/* Program/erase parallelism in bits, F4 only. It goes by the supply: 8 at
+ * 1.8-2.1V, 16 at 2.1-2.7V, 32 at 2.7-3.6V, and 64 with VPP applied. */
+#if !defined(FLASH_PSIZE)
+#define FLASH_PSIZE				32
+#endif
 
 #if defined(stm32f1) || defined(stm32f3)
 #include "flash_f1.h"
@@ -12,6 +12,10 @@
 #define FLASH_ADDR_END				0x0807ffff /* sector no. 256 */
 #endif
 #define NSECTORS				FLASH_ADDR_END
+/* the free-sector map of flash.c takes a bit per 1KB, the smallest page */
+#define FLASH_MAP_UNIT				1024
+#define FLASH_MAP_SIZE				((FLASH_ADDR_END + 1 - 0x08000000) \
+						 / FLASH_MAP_UNIT)
 
 #define FLASH_OPT_UNLOCK_KEY1			0x45670123
 #define FLASH_OPT_UNLOCK_KEY2			0xCDEF89AB
@@ -38,24 +42,6 @@ enum flash_status_bits {
 	FLASH_STATUS_ERROR_MASK			= 0x14,
 };
 
-static inline unsigned int get_temporal_sector_addr(int size)
-{
-	/* TODO: do management algorithm to maximize lifetime
-	 * 1. when booting read all sectors and make a mapping of free sectors
-	 * 2. allocate random sectors in the mapping
-	 * 3. temporal sector and all the unused sector should be erased to be
-	 *    checked as free sector when booting
-	 *
-	 * or
-	 *
-	 * Reserve a flash sector to save mapping */
-	//return 0x08007c00; /* low-density */
-	//return 0x0801fc00; /* medium-density */
-	return 0x0807f800; /* high-density */
-	return 0x0803f800; /* connectivity line devices */
-	(void)size;
-}
-
 static inline void flash_lock_opt()
 {
 }
@@ -77,4 +63,11 @@ static inline int addr2sector(void *p)
 	return (int)p;
 }
 
+/* A single bank, stalling any fetch from flash while busy */
+static inline int addr2bank(void *p)
+{
+	(void)p;
+	return 1;
+}
+
 #endif /* __STM32F1_FLASH_H__ */
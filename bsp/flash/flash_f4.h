@@ -2,6 +2,9 @@
 #define __STM32F4_FLASH_H__
 
 #define NSECTORS				24
+/* the free-sector map of flash.c takes a bit per 16KB, the smallest sector */
+#define FLASH_MAP_UNIT				0x4000
+#define FLASH_MAP_SIZE				(0x200000 / FLASH_MAP_UNIT)
 
 #define FLASH_OPT_UNLOCK_KEY1			0x08192A3B
 #define FLASH_OPT_UNLOCK_KEY2			0x4C5D6E7F
@@ -69,21 +72,6 @@ enum flash_status_bits {
  * Bank 2 | 0x1FFE_C000 - 0x1FFE_C00F | 16bytes
  */
 
-static inline unsigned int get_temporal_sector_addr(int size)
-{
-	/* TODO: do management algorithm to maximize lifetime
-	 * 1. when booting read all sectors and make a mapping of free sectors
-	 * 2. allocate random sectors in the mapping
-	 * 3. temporal sector and all the unused sector should be erased to be
-	 *    checked as free sector when booting
-	 *
-	 * or
-	 *
-	 * Reserve a flash sector to save mapping */
-	return 0x081e0000;
-	(void)size;
-}
-
 static inline int get_sector_size_kb(int sector)
 {
 	if ((sector >= 0 && sector < 4) || /* bank 1 */
@@ -103,10 +91,12 @@ static inline int addr2sector(void *p)
 	unsigned int addr = (unsigned int)p;
 	int sector;
 
-	if (addr & 0xe0000) /* sector[4|16] ~ sector[11|23] */
+	if (addr & 0xe0000) /* sector[5|17] ~ sector[11|23] */
 		sector = ((addr & 0xe0000) >> 17) + 4;
+	else if (addr & 0x10000) /* sector[4|16] */
+		sector = 4;
 	else
-		sector = ((addr & 0x1f000) >> 14);
+		sector = ((addr & 0xc000) >> 14);
 
 	if (addr & 0x100000)
 		sector += 12;
@@ -114,13 +104,20 @@ static inline int addr2sector(void *p)
 	return sector;
 }
 
+/* Sectors 12-23 are bank 2, which can be read from, and run from, while
+ * bank 1 is busy erasing or programming, and the other way around */
+static inline int addr2bank(void *p)
+{
+	return ((unsigned int)p & 0x100000)? 2 : 1;
+}
+
 static inline void flash_writesize_set(int bits)
 {
 	unsigned int tmp;
 
 	tmp = FLASH_CR;
 	tmp &= ~(3U << BIT_FLASH_PROGRAM_SIZE);
-	tmp |= (bits >> 4) << BIT_FLASH_PROGRAM_SIZE;
+	tmp |= (unsigned int)(__builtin_ctz(bits) - 3) << BIT_FLASH_PROGRAM_SIZE;
 
 	FLASH_CR = tmp;
 }
@@ -129,7 +126,7 @@ static inline int flash_writesize_get()
 {
 	int bits;
 
-	switch (FLASH_CR & (3U << BIT_FLASH_PROGRAM_SIZE)) {
+	switch ((FLASH_CR >> BIT_FLASH_PROGRAM_SIZE) & 3U) {
 	case 1:
 		bits = 16;
 		break;
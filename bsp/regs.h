@@ -1,11 +1,22 @@
 #ifndef __REGS_H__
 #define __REGS_H__
 
+#if defined(HOST)
+#include "emu.h"
+#else
 #define SCB_BASE		(0xE000E000)
 #define SCB_VTOR		(*(volatile unsigned int *)(SCB_BASE + 0xD08))
 #define SCB_AIRCR		(*(volatile unsigned int *)(SCB_BASE + 0xD0C))
 #define SCB_CCR 		(*(volatile unsigned int *)(SCB_BASE + 0xD14))
 
+#define NVIC_ISER(n)		(*(volatile unsigned int *)(SCB_BASE + 0x100 + 4 * (n)))
+#define NVIC_ICER(n)		(*(volatile unsigned int *)(SCB_BASE + 0x180 + 4 * (n)))
+#define NVIC_ICPR(n)		(*(volatile unsigned int *)(SCB_BASE + 0x280 + 4 * (n)))
+
+#define DEMCR			(*(volatile unsigned int *)(SCB_BASE + 0xDFC))
+#define DWT_CTRL		(*(volatile unsigned int *)0xE0001000)
+#define DWT_CYCCNT		(*(volatile unsigned int *)0xE0001004)
+
 /* Embedded Flash memory */
 #if defined(stm32f1) || defined(stm32f3)
 #define FLASH_BASE		(0x40022000)
@@ -20,6 +31,20 @@
 
 #define FLASH_OPT_BASE		(0x1ffff800)
 #define FLASH_OPT_RDP		(*(volatile unsigned short int *)FLASH_OPT_BASE)
+
+#define UID_BASE		(0x1ffff7e8)
+
+#define RCC_CR			(*(volatile unsigned int *)0x40021000)
+#define RCC_CFGR		(*(volatile unsigned int *)0x40021004)
+#define RCC_AHBENR		(*(volatile unsigned int *)0x40021014)
+#define RCC_AHBENR_CRCEN	(1U << 6)
+#define RCC_APB2ENR		(*(volatile unsigned int *)0x40021018)
+#define RCC_APB2ENR_IOPAEN	(1U << 2)
+#define RCC_APB2ENR_USART1EN	(1U << 14)
+
+#define GPIOA_CRH		(*(volatile unsigned int *)0x40010804)
+
+#define USART1_BASE		(0x40013800)
 #elif defined(stm32f4)
 #define FLASH_BASE		(0x40023c00)
 #define FLASH_ACR		(*(volatile unsigned int *)FLASH_BASE)
@@ -31,18 +56,43 @@
 
 #define FLASH_OPT_BASE		(0x1fffc000)
 #define FLASH_OPT_RDP		(*(volatile unsigned short int *)FLASH_OPT_BASE)
+
+#define UID_BASE		(0x1fff7a10)
+
+#define RCC_CR			(*(volatile unsigned int *)0x40023800)
+#define RCC_PLLCFGR		(*(volatile unsigned int *)0x40023804)
+#define RCC_CFGR		(*(volatile unsigned int *)0x40023808)
+#define RCC_AHBENR		(*(volatile unsigned int *)0x40023830) /* AHB1ENR */
+#define RCC_AHBENR_GPIOAEN	(1U << 0)
+#define RCC_AHBENR_CRCEN	(1U << 12)
+#define RCC_APB2ENR		(*(volatile unsigned int *)0x40023844)
+#define RCC_APB2ENR_USART1EN	(1U << 4)
+#define RCC_APB2ENR_SYSCFGEN	(1U << 14)
+
+/* Pins go by mode and alternate function, PA9 and PA10 to AF7 for USART1 */
+#define GPIOA_MODER		(*(volatile unsigned int *)0x40020000)
+#define GPIOA_AFRH		(*(volatile unsigned int *)0x40020024)
+
+#define USART1_BASE		(0x40011000)
+
+/* FB_MODE maps bank 2 at 0x08000000 and bank 1 at 0x08100000 */
+#define SYSCFG_MEMRMP		(*(volatile unsigned int *)0x40013800)
+#define SYSCFG_MEMRMP_FB_MODE	(1U << 8)
 #else
 #error undefined machine
 #endif
 
-#define RCC_BASE		(0x40021000)
-#define RCC_APB2ENR		(*(volatile unsigned int *)(RCC_BASE + 0x18))
+/* Same USART registers on both, at USART1_BASE */
+#define USART1_SR		(*(volatile unsigned int *)USART1_BASE)
+#define USART1_DR		(*(volatile unsigned int *)(USART1_BASE + 0x4))
+#define USART1_BRR		(*(volatile unsigned int *)(USART1_BASE + 0x8))
+#define USART1_CR1		(*(volatile unsigned int *)(USART1_BASE + 0xc))
 
-#define GPIOA_CRH		(*(volatile unsigned int *)0x40010804)
+/* Same CRC unit and address on both */
+#define CRC_DR			(*(volatile unsigned int *)0x40023000)
+#define CRC_CR			(*(volatile unsigned int *)0x40023008)
+#endif /* HOST */
 
-#define USART1_SR		(*(volatile unsigned int *)0x40013800)
-#define USART1_DR		(*(volatile unsigned int *)0x40013804)
-#define USART1_BRR		(*(volatile unsigned int *)0x40013808)
-#define USART1_CR1		(*(volatile unsigned int *)0x4001380c)
+#define UID_SIZE		12 /* 96-bit unique device ID */
 
 #endif /* __REGS_H__ */
@@ -0,0 +1,120 @@
+#include "bsp.h"
+#include "clock.h"
+
+#define HSE_STARTUP			20000 /* polls, well over tSU(HSE) */
+
+enum {
+	RCC_HSEON	= 16,
+	RCC_HSERDY	= 17,
+	RCC_PLLON	= 24,
+	RCC_PLLRDY	= 25,
+};
+
+#define RCC_SW_PLL			2U
+#define RCC_SWS_MASK			(3U << 2)
+
+#if defined(stm32f4)
+/* 1MHz into the VCO, x336 and /2 for SYSCLK, /7 for 48MHz USB */
+#define PLLCFGR(src_hz, src)		(((src_hz) / 1000000UL) \
+		| (336U << 6) | (0U << 16) | ((src) << 22) | (7U << 24))
+#define PLL_HSE				PLLCFGR(HSE_HZ, 1U)
+#define PLL_HSI				PLLCFGR(HSI_HZ, 0U)
+#define PLLCFGR_RESET			0x24003010U
+#define SYSCLK_HSE_HZ			168000000UL
+#define SYSCLK_HSI_HZ			168000000UL
+/* AHB /1, APB1 /4 up to 42MHz, APB2 /2 up to 84MHz */
+#define CFGR_BUS			((5U << 10) | (4U << 13))
+#define PCLK2_DIV			2
+
+enum {
+	ACR_PRFTEN	= 8,
+	ACR_ICEN	= 9,
+	ACR_DCEN	= 10,
+	ACR_ICRST	= 11,
+	ACR_DCRST	= 12,
+};
+/* 5 wait states for 150-168MHz at 2.7-3.6V */
+#define ACR_FAST			(5U | (1U << ACR_PRFTEN) \
+		| (1U << ACR_ICEN) | (1U << ACR_DCEN))
+#define ACR_RESET			0U
+#else
+/* HSE x9, or HSI/2 x16 as close as it gets */
+#define PLL_HSE				((1U << 16) | (7U << 18))
+#define PLL_HSI				(14U << 18)
+#define SYSCLK_HSE_HZ			72000000UL
+#define SYSCLK_HSI_HZ			64000000UL
+/* AHB /1, APB1 /2 up to 36MHz, APB2 /1 */
+#define CFGR_BUS			(4U << 8)
+#define PCLK2_DIV			1
+
+/* prefetch on as out of reset, 2 wait states for 48-72MHz */
+#define ACR_FAST			(0x10U | 2U)
+#define ACR_RESET			0x30U
+#endif
+
+static unsigned long hclk = HSI_HZ, pclk2 = HSI_HZ;
+
+/* whatever was set last, as long as not back on the HSI since, by a reset */
+unsigned long clock_hclk(void)
+{
+	return (RCC_CFGR & RCC_SWS_MASK)? hclk : HSI_HZ;
+}
+
+unsigned long clock_pclk2(void)
+{
+	return (RCC_CFGR & RCC_SWS_MASK)? pclk2 : HSI_HZ;
+}
+
+void clock_init(void)
+{
+#if defined(FASTCLOCK)
+	unsigned int pll = PLL_HSE;
+	unsigned long sysclk = SYSCLK_HSE_HZ;
+
+	RCC_CR |= 1U << RCC_HSEON;
+	for (int i = 0; i < HSE_STARTUP; i++) {
+		if (RCC_CR & (1U << RCC_HSERDY))
+			break;
+	}
+	if (!(RCC_CR & (1U << RCC_HSERDY))) {
+		RCC_CR &= ~(1U << RCC_HSEON);
+		pll = PLL_HSI;
+		sysclk = SYSCLK_HSI_HZ;
+	}
+
+#if defined(stm32f4)
+	RCC_PLLCFGR = pll;
+	RCC_CFGR = CFGR_BUS;
+#else
+	RCC_CFGR = CFGR_BUS | pll;
+#endif
+	RCC_CR |= 1U << RCC_PLLON;
+	while (!(RCC_CR & (1U << RCC_PLLRDY)));
+
+	/* wait states go up before the clock does */
+	FLASH_ACR = ACR_FAST;
+	RCC_CFGR |= RCC_SW_PLL;
+	while ((RCC_CFGR & RCC_SWS_MASK) != (RCC_SW_PLL << 2));
+
+	hclk = sysclk;
+	pclk2 = sysclk / PCLK2_DIV;
+#endif
+}
+
+void clock_deinit(void)
+{
+#if defined(FASTCLOCK)
+	RCC_CFGR &= ~3U; /* HSI */
+	while (RCC_CFGR & RCC_SWS_MASK);
+	RCC_CR &= ~((1U << RCC_PLLON) | (1U << RCC_HSEON));
+	RCC_CFGR = 0;
+#if defined(stm32f4)
+	RCC_PLLCFGR = PLLCFGR_RESET;
+	/* caches flushed so that the application starts on a clean slate */
+	FLASH_ACR = 0;
+	FLASH_ACR = (1U << ACR_ICRST) | (1U << ACR_DCRST);
+#endif
+	/* and wait states down after the clock */
+	FLASH_ACR = ACR_RESET;
+#endif
+}
@@ -0,0 +1,22 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#if defined(stm32f4)
+#define HSI_HZ			16000000UL
+#else
+#define HSI_HZ			8000000UL
+#endif
+#define HSE_HZ			8000000UL /* on the board */
+
+/* With FASTCLOCK defined, SYSCLK goes up to 72MHz on F1 and 168MHz on F4
+ * off the PLL, from the HSE or from the HSI when the HSE doesn't start, with
+ * flash wait states, prefetch and on F4 the ART caches set to match.
+ * clock_deinit() puts all of it back to the reset state for the
+ * application. Without FASTCLOCK both are no-ops running on the HSI. */
+void clock_init(void);
+void clock_deinit(void);
+unsigned long clock_hclk(void);
+/* USART1 kernel clock */
+unsigned long clock_pclk2(void);
+
+#endif /* __CLOCK_H__ */
@@ -0,0 +1,67 @@
+#include "crc.h"
+#include "bsp.h"
+
+#include <string.h>
+
+#define CRC_POLY		0x04C11DB7U
+
+static uint32_t crc_byte(uint32_t crc, uint8_t b)
+{
+	crc ^= (uint32_t)b << 24;
+	for (int i = 0; i < 8; i++)
+		crc = (crc << 1) ^ ((crc & 0x80000000U)? CRC_POLY : 0);
+	return crc;
+}
+
+#if defined(HOST)
+static uint32_t table[256];
+
+static void build_table(void)
+{
+	for (int i = 0; i < 256; i++)
+		table[i] = crc_byte(0, (uint8_t)i);
+}
+
+uint32_t crc32(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t crc = 0xffffffffU;
+
+	if (!table[1])
+		build_table();
+
+	/* a word goes in most significant byte first */
+	for (; len >= 4; len -= 4, p += 4)
+		for (int i = 3; i >= 0; i--)
+			crc = (crc << 8) ^ table[(crc >> 24) ^ p[i]];
+
+	for (; len; len--)
+		crc = crc_byte(crc, *p++);
+
+	return crc;
+}
+#else
+#define CRC_CR_RESET		(1U << 0)
+
+uint32_t crc32(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t crc, w;
+
+	RCC_AHBENR |= RCC_AHBENR_CRCEN;
+	CRC_CR = CRC_CR_RESET;
+
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(&w, p, sizeof(w)); /* unaligned LDR is fine on ARMv7-M */
+		CRC_DR = w;
+	}
+	crc = CRC_DR;
+
+	RCC_AHBENR &= ~RCC_AHBENR_CRCEN;
+
+	for (; len; len--)
+		crc = crc_byte(crc, *p++);
+
+	return crc;
+}
+#endif
@@ -0,0 +1,14 @@
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC-32/MPEG-2 as the STM32 CRC unit computes it: polynomial 0x04C11DB7,
+ * initial value all ones, nothing reflected or inverted, over little
+ * endian words, the trailing bytes being fed one at a time. It is only
+ * there to turn a corrupt image away before the signature check, never to
+ * accept one. On the host it is done with a table. */
+uint32_t crc32(const void *data, size_t len);
+
+#endif /* __CRC_H__ */
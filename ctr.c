@@ -0,0 +1,172 @@
+#if defined(FASTAES)
+/* AES-128-CTR with a single T-table, the other three columns being its
+ * rotations, which Cortex-M3/M4 fold into the EOR for free. The state is
+ * kept in little endian words so that nothing gets byte swapped but the
+ * counter. Only the counter word changes from block to block, so the part
+ * of the first round the other three words contribute is taken once per
+ * call. The keystream is XORed into the output a word at a time.
+ *
+ * The tables are built in RAM at the first ctr_setkey(), 1.25KB, rather
+ * than read from flash behind its wait states. */
+
+#include "ctr.h"
+
+#include <string.h>
+
+#define ROR(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#define B0(x)			((x) & 0xff)
+#define B1(x)			(((x) >> 8) & 0xff)
+#define B2(x)			(((x) >> 16) & 0xff)
+#define B3(x)			((x) >> 24)
+
+static uint32_t te[256];
+static uint8_t sbox[256];
+
+static uint8_t xtime(uint8_t x)
+{
+	return (uint8_t)((x << 1) ^ ((x & 0x80)? 0x1b : 0));
+}
+
+static void build_tables(void)
+{
+	uint8_t p = 1, q = 1, s, s2;
+
+	/* p runs through the multiplicative group by 3 and q by its
+	 * inverse, so q is the inverse of p all along */
+	do {
+		p ^= xtime(p);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+		s = q ^ (uint8_t)((q << 1) | (q >> 7))
+			^ (uint8_t)((q << 2) | (q >> 6))
+			^ (uint8_t)((q << 3) | (q >> 5))
+			^ (uint8_t)((q << 4) | (q >> 4));
+		sbox[p] = s ^ 0x63;
+	} while (p != 1);
+	sbox[0] = 0x63;
+
+	for (int i = 0; i < 256; i++) {
+		s = sbox[i];
+		s2 = xtime(s);
+		te[i] = s2 | ((uint32_t)s << 8) | ((uint32_t)s << 16)
+			| ((uint32_t)(s2 ^ s) << 24);
+	}
+}
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v)); /* unaligned LDR is fine on ARMv7-M */
+	return v;
+}
+
+static inline void store_le32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t subword(uint32_t x)
+{
+	return sbox[B0(x)] | ((uint32_t)sbox[B1(x)] << 8)
+		| ((uint32_t)sbox[B2(x)] << 16)
+		| ((uint32_t)sbox[B3(x)] << 24);
+}
+
+void ctr_setkey(struct ctr_key *key, const uint8_t *aeskey)
+{
+	uint32_t *rk = key->rk, t;
+	uint8_t rcon = 1;
+
+	if (!sbox[0]) /* 0x63 once built */
+		build_tables();
+
+	for (int i = 0; i < 4; i++)
+		rk[i] = load_le32(&aeskey[i * 4]);
+
+	for (int i = 4; i < 44; i++) {
+		t = rk[i - 1];
+		if (!(i & 3)) {
+			t = subword(ROR(t, 8)) ^ rcon;
+			rcon = xtime(rcon);
+		}
+		rk[i] = rk[i - 4] ^ t;
+	}
+}
+
+#define T(a, b, c, d) \
+	(te[B0(a)] ^ ROR(te[B1(b)], 24) ^ ROR(te[B2(c)], 16) ^ \
+	 ROR(te[B3(d)], 8))
+#define S(a, b, c, d) \
+	(sbox[B0(a)] | ((uint32_t)sbox[B1(b)] << 8) | \
+	 ((uint32_t)sbox[B2(c)] << 16) | ((uint32_t)sbox[B3(d)] << 24))
+
+/* `c` holds what the constant words contribute to the first round, along
+ * with the first two round keys, and `s3` the counter word after the
+ * first one. */
+static inline void encrypt(uint32_t *out, const uint32_t *c, uint32_t s3,
+		const uint32_t *rk)
+{
+	uint32_t s0, s1, s2, t0, t1, t2, t3;
+
+	t0 = c[0] ^ ROR(te[B3(s3)], 8);
+	t1 = c[1] ^ ROR(te[B2(s3)], 16);
+	t2 = c[2] ^ ROR(te[B1(s3)], 24);
+	t3 = c[3] ^ te[B0(s3)];
+
+	for (int i = 8; i < 40; i += 8) {
+		s0 = T(t0, t1, t2, t3) ^ rk[i];
+		s1 = T(t1, t2, t3, t0) ^ rk[i + 1];
+		s2 = T(t2, t3, t0, t1) ^ rk[i + 2];
+		s3 = T(t3, t0, t1, t2) ^ rk[i + 3];
+		t0 = T(s0, s1, s2, s3) ^ rk[i + 4];
+		t1 = T(s1, s2, s3, s0) ^ rk[i + 5];
+		t2 = T(s2, s3, s0, s1) ^ rk[i + 6];
+		t3 = T(s3, s0, s1, s2) ^ rk[i + 7];
+	}
+
+	out[0] = S(t0, t1, t2, t3) ^ rk[40];
+	out[1] = S(t1, t2, t3, t0) ^ rk[41];
+	out[2] = S(t2, t3, t0, t1) ^ rk[42];
+	out[3] = S(t3, t0, t1, t2) ^ rk[43];
+}
+
+void ctr_crypt(uint8_t *out, const uint8_t *in, size_t len, uint8_t *ctr,
+		const struct ctr_key *key)
+{
+	const uint32_t *rk = key->rk;
+	uint32_t x0, x1, x2, c[4], ks[4], n;
+
+	x0 = load_le32(&ctr[0]) ^ rk[0];
+	x1 = load_le32(&ctr[4]) ^ rk[1];
+	x2 = load_le32(&ctr[8]) ^ rk[2];
+	n = __builtin_bswap32(load_le32(&ctr[12]));
+
+	c[0] = te[B0(x0)] ^ ROR(te[B1(x1)], 24) ^ ROR(te[B2(x2)], 16)
+		^ rk[4];
+	c[1] = te[B0(x1)] ^ ROR(te[B1(x2)], 24) ^ ROR(te[B3(x0)], 8)
+		^ rk[5];
+	c[2] = te[B0(x2)] ^ ROR(te[B2(x0)], 16) ^ ROR(te[B3(x1)], 8)
+		^ rk[6];
+	c[3] = ROR(te[B1(x0)], 24) ^ ROR(te[B2(x1)], 16)
+		^ ROR(te[B3(x2)], 8) ^ rk[7];
+
+	for (; len >= CTR_BLOCK_SIZE; len -= CTR_BLOCK_SIZE, n++) {
+		encrypt(ks, c, __builtin_bswap32(n) ^ rk[3], rk);
+		for (int i = 0; i < 4; i++, in += 4, out += 4)
+			store_le32(out, load_le32(in) ^ ks[i]);
+	}
+
+	if (len) {
+		encrypt(ks, c, __builtin_bswap32(n) ^ rk[3], rk);
+		for (size_t i = 0; i < len; i++)
+			out[i] = in[i] ^ ((const uint8_t *)ks)[i];
+		n++;
+	}
+
+	store_le32(&ctr[12], __builtin_bswap32(n));
+}
+#endif /* FASTAES */
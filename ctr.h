@@ -0,0 +1,43 @@
+#ifndef __CTR_H__
+#define __CTR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CTR_BLOCK_SIZE			16
+
+/* AES-128 in CTR mode for the images, counting blocks in the last four
+ * bytes of the counter, big endian, as tinycrypt does. With FASTAES
+ * defined it is the T-table one in ctr.c, otherwise tinycrypt's. `ctr` is
+ * left at the block following the last one used. */
+#if defined(FASTAES)
+struct ctr_key {
+	uint32_t rk[44];
+};
+
+void ctr_setkey(struct ctr_key *key, const uint8_t *aeskey);
+void ctr_crypt(uint8_t *out, const uint8_t *in, size_t len, uint8_t *ctr,
+		const struct ctr_key *key);
+#else
+#include "tinycrypt/aes.h"
+#include "tinycrypt/ctr_mode.h"
+
+struct ctr_key {
+	struct tc_aes_key_sched_struct tc;
+};
+
+static inline void ctr_setkey(struct ctr_key *key, const uint8_t *aeskey)
+{
+	tc_aes128_set_encrypt_key(&key->tc, aeskey);
+}
+
+static inline void ctr_crypt(uint8_t *out, const uint8_t *in, size_t len,
+		uint8_t *ctr, const struct ctr_key *key)
+{
+	if (len)
+		tc_ctr_mode(out, len, in, len, ctr,
+				(TCAesKeySched_t)&key->tc);
+}
+#endif
+
+#endif /* __CTR_H__ */
@@ -0,0 +1,152 @@
+#if defined(DELTA)
+/* Patch comes out of E(Patch) a block at a time and Data goes into flash a
+ * chunk at a time, re-encrypted with the counter running from IV of the
+ * image, so what gets programmed is E(Data) as signed, to be installed like
+ * any other staged image. */
+
+#include "delta.h"
+#include "bsp.h"
+#include "flash.h"
+#include "ctr.h"
+
+#include <string.h>
+
+#if !defined(CHUNK_SIZE)
+#define CHUNK_SIZE			1024
+#endif
+#define DELTA_BLOCK_SIZE		256 /* of E(Patch) decrypted at once */
+
+_Static_assert(DELTA_BLOCK_SIZE % CTR_BLOCK_SIZE == 0,
+		"DELTA_BLOCK_SIZE must be a multiple of the AES block");
+
+struct patch {
+	const uint8_t *src, *end;
+	uint8_t ctr[INITIAL_VECTOR_SIZE];
+	uint8_t buf[DELTA_BLOCK_SIZE];
+	size_t pos, n;
+};
+
+struct output {
+	uint8_t *dst;
+	uint32_t off, len;
+	uint8_t ctr[INITIAL_VECTOR_SIZE];
+	uint8_t buf[CHUNK_SIZE];
+	size_t n;
+	int err;
+};
+
+static int refill(struct patch *p, const struct ctr_key *key)
+{
+	if (p->pos < p->n)
+		return 0;
+	if (p->src == p->end)
+		return -1;
+
+	p->n = min((size_t)(p->end - p->src), sizeof(p->buf));
+	ctr_crypt(p->buf, p->src, p->n, p->ctr, key);
+	p->src += p->n;
+	p->pos = 0;
+
+	return 0;
+}
+
+static int get_varint(struct patch *p, const struct ctr_key *key,
+		uint32_t *v)
+{
+	uint8_t c;
+
+	*v = 0;
+	for (int shift = 0; shift < 32; shift += 7) {
+		if (refill(p, key))
+			return -1;
+		c = p->buf[p->pos++];
+		*v |= (uint32_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+static void flush(struct output *o, const struct ctr_key *key)
+{
+	ctr_crypt(o->buf, o->buf, o->n, o->ctr, key);
+	if (flash_program(&o->dst[o->off], o->buf, o->n) < o->n)
+		o->err = -1;
+	o->off += o->n;
+	o->n = 0;
+}
+
+static void put(struct output *o, const uint8_t *data, size_t len,
+		const struct ctr_key *key)
+{
+	size_t n;
+
+	for (; len; len -= n, data += n) {
+		n = min(len, sizeof(o->buf) - o->n);
+		memcpy(&o->buf[o->n], data, n);
+		o->n += n;
+		if (o->n == sizeof(o->buf))
+			flush(o, key);
+	}
+}
+
+int delta_apply(void *out, const struct deltaimg_t *delta, const void *base,
+		size_t len, const void *aeskey)
+{
+	struct ctr_key ctx;
+	struct patch patch;
+	struct output o;
+	uint32_t op, n, d, pos, left;
+
+	o.dst = (uint8_t *)out + sizeof(struct appimg_t);
+	o.off = o.n = 0;
+	o.len = delta->target.len;
+	o.err = flash_erase_range(out, sizeof(struct appimg_t) + o.len);
+	memcpy(o.ctr, delta->target.iv, sizeof(o.ctr));
+
+	patch.src = delta->data;
+	patch.end = &delta->data[delta->len];
+	patch.pos = patch.n = 0;
+	memcpy(patch.ctr, delta->iv, sizeof(patch.ctr));
+
+	ctr_setkey(&ctx, aeskey);
+
+	for (pos = 0; !o.err && (left = o.len - o.off - o.n); ) {
+		if (get_varint(&patch, &ctx, &op) || (n = op >> 1) > left)
+			return -1;
+
+		if ((op & 1) == DELTA_COPY) {
+			if (get_varint(&patch, &ctx, &d))
+				return -1;
+			pos += (d >> 1) ^ -(d & 1);
+			if (pos > len || n > len - pos)
+				return -1;
+			put(&o, (const uint8_t *)base + pos, n, &ctx);
+			pos += n;
+			continue;
+		}
+
+		while (n) {
+			if (refill(&patch, &ctx))
+				return -1;
+			d = min(n, (uint32_t)(patch.n - patch.pos));
+			put(&o, &patch.buf[patch.pos], d, &ctx);
+			patch.pos += d;
+			n -= d;
+		}
+	}
+
+	if (o.n)
+		flush(&o, &ctx);
+	if (o.err || patch.pos < patch.n || patch.src < patch.end)
+		return -1;
+
+	/* Flash meta data last, as install() does */
+	if (flash_program(out, &delta->target, sizeof(struct appimg_t))
+			< sizeof(struct appimg_t))
+		return -1;
+
+	return 0;
+}
+#endif /* DELTA */
@@ -0,0 +1,32 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include "image.h"
+
+#include <stddef.h>
+
+/* Patch, once decrypted, is a run of ops, each a varint, 7 bits a byte
+ * from the least significant and the top bit telling another byte follows,
+ * of LEN << 1 | OP:
+ *
+ *	DELTA_COPY	followed by a zigzag varint, where to copy LEN bytes of
+ *			the app from relative to where the previous copy ended
+ *	DELTA_INSERT	followed by LEN bytes as they are
+ *
+ * and adds up to Data of the image it makes. The app is only read from. */
+enum {
+	DELTA_COPY	= 0,
+	DELTA_INSERT	= 1,
+};
+
+#if defined(DELTA)
+/* Programs at `out` the image `delta` makes of the `len` bytes of app at
+ * `base`, E(Data) as the ops come with Data encrypted again the way it was
+ * signed, and its header last. RAM takes a chunk of either side at a time.
+ * Returns 0, or -1 on ops that read past the app, don't add up to LEN of the
+ * image, or that did not make it to flash. */
+int delta_apply(void *out, const struct deltaimg_t *delta, const void *base,
+		size_t len, const void *aeskey);
+#endif
+
+#endif /* __DELTA_H__ */
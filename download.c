@@ -0,0 +1,295 @@
+#include "bsp.h"
+#include "flash.h"
+#include "uart.h"
+#include "download.h"
+#include "clock.h"
+
+#include <string.h>
+
+#define DL_HDR_SIZE			4 /* TYPE, SEQ and LEN */
+#define DL_PAYLOAD_MAX			(4 + DL_DATA_MAX)
+#define DL_PROBE			125 /* polls per MHz, a few byte times */
+
+#define __iap				__attribute__((section(".iap")))
+
+enum {
+	RX_SOF,
+	RX_TYPE,
+	RX_SEQ,
+	RX_LEN0,
+	RX_LEN1,
+	RX_PAYLOAD,
+	RX_CRC0,
+	RX_CRC1,
+};
+
+struct frame {
+	uint8_t type;
+	uint8_t seq;
+	uint16_t len;
+	uint8_t payload[DL_PAYLOAD_MAX];
+} __attribute__((aligned(4)));
+
+/* Received in the background, from the flash idle hook as well, into
+ * buf[head], and handed over to programming at buf[tail]. */
+static struct {
+	struct frame buf[DL_NBUFS];
+	volatile unsigned int head, tail;
+	volatile int nak;
+
+	int state;
+	unsigned int n;
+	uint16_t crc, rxcrc;
+} dl;
+
+static uint16_t __iap crc16(uint16_t crc, uint8_t c)
+{
+	crc ^= (uint16_t)(c << 8);
+	for (int i = 0; i < 8; i++)
+		crc = (crc & 0x8000)? (uint16_t)((crc << 1) ^ 0x1021) :
+			(uint16_t)(crc << 1);
+
+	return crc;
+}
+
+static void __iap rx(uint8_t c)
+{
+	struct frame *f = &dl.buf[dl.head % DL_NBUFS];
+
+	switch (dl.state) {
+	case RX_SOF:
+		/* no room means a sender not keeping to the window */
+		if (c != DL_SOF || dl.head - dl.tail >= DL_NBUFS)
+			return;
+		dl.crc = 0xffff;
+		dl.state = RX_TYPE;
+		return;
+	case RX_TYPE:
+		f->type = c;
+		break;
+	case RX_SEQ:
+		f->seq = c;
+		break;
+	case RX_LEN0:
+		f->len = c;
+		break;
+	case RX_LEN1:
+		f->len |= (uint16_t)(c << 8);
+		if (f->len > DL_PAYLOAD_MAX) {
+			dl.state = RX_SOF;
+			dl.nak = 1;
+			return;
+		}
+		dl.n = 0;
+		dl.crc = crc16(dl.crc, c);
+		dl.state = f->len? RX_PAYLOAD : RX_CRC0;
+		return;
+	case RX_PAYLOAD:
+		f->payload[dl.n++] = c;
+		dl.crc = crc16(dl.crc, c);
+		if (dl.n == f->len)
+			dl.state = RX_CRC0;
+		return;
+	case RX_CRC0:
+		dl.rxcrc = c;
+		dl.state = RX_CRC1;
+		return;
+	case RX_CRC1:
+		if ((uint16_t)(dl.rxcrc | (c << 8)) == dl.crc)
+			dl.head++;
+		else
+			dl.nak = 1;
+		dl.state = RX_SOF;
+		return;
+	default:
+		dl.state = RX_SOF;
+		return;
+	}
+
+	dl.crc = crc16(dl.crc, c);
+	dl.state++;
+}
+
+static void __iap poll(void)
+{
+	int c;
+
+	uart_poll();
+	while ((c = uart_tryget()) >= 0)
+		rx((uint8_t)c);
+}
+
+static void send(uint8_t type, uint8_t seq, const uint8_t *payload,
+		uint16_t len)
+{
+	uint8_t hdr[DL_HDR_SIZE] = { type, seq,
+		(uint8_t)len, (uint8_t)(len >> 8) };
+	uint16_t crc = 0xffff;
+
+	uart_put(DL_SOF);
+	for (int i = 0; i < DL_HDR_SIZE; i++) {
+		crc = crc16(crc, hdr[i]);
+		uart_put(hdr[i]);
+	}
+	for (int i = 0; i < len; i++) {
+		crc = crc16(crc, payload[i]);
+		uart_put(payload[i]);
+	}
+	uart_put((uint8_t)crc);
+	uart_put((uint8_t)(crc >> 8));
+}
+
+static void ack(uint8_t seq, uint8_t status)
+{
+	send(DL_ACK, seq, &status, 1);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Erased up to the end of the sector `addr` is in */
+static uintptr_t sector_end(uintptr_t addr)
+{
+	unsigned int ss;
+
+	ss = (unsigned int)get_sector_size_kb(addr2sector((void *)addr)) << 10;
+
+	return BASE_ALIGN(addr, ss) + ss;
+}
+
+/* The sector at `erased` goes as soon as the one before it is full rather
+ * than when data for it comes in, in the background on the other bank of a
+ * dual-bank part, frames being taken in meanwhile. A failure is left for
+ * the data to find. */
+static uintptr_t erase_ahead(uintptr_t erased, uintptr_t next, uintptr_t end)
+{
+	if (next != erased || next >= end || flash_erase_start((void *)erased))
+		return erased;
+
+	return sector_end(erased);
+}
+
+int download_requested(void)
+{
+	unsigned long n = clock_hclk() / 1000000UL * DL_PROBE;
+
+	for (unsigned long i = 0; i < n; i++) {
+		uart_poll();
+		if (uart_tryget() >= 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+size_t download(void *dst, size_t size,
+		int (*check)(const void *dst, size_t len),
+		size_t (*put)(uint8_t *dst, uint32_t off, uint8_t *data,
+			size_t n))
+{
+	uint8_t *d = (uint8_t *)dst;
+	uintptr_t erased = 0;
+	uint32_t len = 0, next = 0, off, n;
+	uint8_t expected = 0, status, *data;
+	uint8_t info[4] = { DL_OK, DL_NBUFS,
+		(uint8_t)DL_DATA_MAX, DL_DATA_MAX >> 8 };
+	int started = 0;
+	struct frame *f;
+
+	memset(&dl, 0, sizeof(dl));
+	flash_set_idle(poll);
+
+	while (1) {
+		poll();
+
+		if (dl.nak) {
+			dl.nak = 0;
+			if (started)
+				send(DL_NAK, expected, NULL, 0);
+		}
+		if (dl.head == dl.tail)
+			continue;
+
+		f = &dl.buf[dl.tail % DL_NBUFS];
+
+		switch (f->type) {
+		case DL_START:
+			if (f->len != 4)
+				break;
+			len = get_le32(f->payload);
+			if (!len || len > size) {
+				ack(f->seq, DL_ERANGE);
+				break;
+			}
+			send(DL_ACK, f->seq, info, sizeof(info));
+			started = 1;
+			expected = (uint8_t)(f->seq + 1);
+			next = 0;
+			erased = (uintptr_t)d;
+			break;
+		case DL_DATA:
+			if (!started)
+				break;
+			if (f->seq != expected) {
+				/* acknowledged already, or one went missing */
+				if ((uint8_t)(expected - f->seq) <= DL_NBUFS)
+					ack((uint8_t)(expected - 1), DL_OK);
+				else
+					send(DL_NAK, expected, NULL, 0);
+				break;
+			}
+			off = get_le32(f->payload);
+			n = f->len - 4U;
+			/* only the last one may end off a word, padded below */
+			if (f->len < 4 || off != next || n > len - next ||
+					((n & 3) && off + n != len)) {
+				send(DL_NAK, expected, NULL, 0);
+				break;
+			}
+			data = &f->payload[4];
+			for (uint32_t i = n; i & 3; i++)
+				data[i] = 0xff;
+			if ((uintptr_t)&d[off + n] > erased) {
+				flash_erase_range((void *)erased,
+						(uintptr_t)&d[off + n] - erased);
+				erased = sector_end((uintptr_t)&d[off + n - 1]);
+			}
+			/* with one still erasing, put() gets on with what
+			 * it has to do before programming meanwhile */
+			if ((put? put(d, off, data, n) :
+					flash_program(&d[off], data, n)) < n) {
+				ack(f->seq, DL_EIO);
+				started = 0;
+				break;
+			}
+			next += n;
+			expected++;
+			ack(f->seq, DL_OK);
+			erased = erase_ahead(erased, (uintptr_t)&d[next],
+					(uintptr_t)&d[len]);
+			break;
+		case DL_END:
+			if (!started)
+				break;
+			if (f->seq != expected || next != len) {
+				send(DL_NAK, expected, NULL, 0);
+				break;
+			}
+			status = check(dst, len)? DL_EBADMSG : DL_OK;
+			ack(f->seq, status);
+			started = 0;
+			if (status == DL_OK) {
+				flash_set_idle(uart_poll);
+				return len;
+			}
+			break;
+		default:
+			break;
+		}
+
+		dl.tail++;
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef __DOWNLOAD_H__
+#define __DOWNLOAD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Frames, both ways, are
+ *
+ *	SOF | TYPE | SEQ | LEN | PAYLOAD | CRC
+ *
+ * with LEN and CRC little endian 16-bit, and CRC-16/CCITT-FALSE over TYPE
+ * through PAYLOAD. Anything between frames is ignored.
+ *
+ * The sender starts with DL_START until acknowledged, keeps up to `window`
+ * DL_DATA frames unacknowledged, in order from offset 0, and ends with
+ * DL_END. DL_ACK acknowledges all frames up to SEQ once they are in flash,
+ * and DL_NAK asks for all frames again from SEQ on. */
+#define DL_SOF				0x7e
+#define DL_DATA_MAX			1024
+
+enum {
+	DL_START	= 'S', /* u32 image length */
+	DL_DATA		= 'D', /* u32 offset, data, whole words but the last */
+	DL_END		= 'E',
+	DL_ACK		= 'A', /* u8 status[, u8 window, u16 DL_DATA_MAX] */
+	DL_NAK		= 'N',
+};
+
+enum {
+	DL_OK		= 0,
+	DL_ERANGE,
+	DL_EIO,
+	DL_EBADMSG,
+};
+
+/* Frame buffers, receiving into one while the previous one is programmed.
+ * Frames keep coming in while flash is busy erasing, as long as there are
+ * enough buffers to cover the erase time at the baud rate. */
+#ifndef DL_NBUFS
+#if defined(stm32f4)
+#define DL_NBUFS			16 /* 128KB sector erase at 115200 */
+#else
+#define DL_NBUFS			2
+#endif
+#endif
+
+/* Whether the host is sending already, checked for a few frame times */
+int download_requested(void);
+/* Receives an image into `dst`, of `size` bytes at most, and returns its
+ * length once `check` passes on it, which DL_END is acknowledged with.
+ * `put`, unless NULL, programs each piece in place of it going to `dst` as
+ * it is, `off` into the image, flash being erased ahead of `dst` + `off`
+ * all the same, and returns how much of it made it. */
+size_t download(void *dst, size_t size,
+		int (*check)(const void *dst, size_t len),
+		size_t (*put)(uint8_t *dst, uint32_t off, uint8_t *data,
+			size_t n));
+
+#endif /* __DOWNLOAD_H__ */
@@ -0,0 +1,621 @@
+#if defined(ED25519) || defined(HOST)
+/* Ed25519 signature verification, RFC 8032, over the image digest.
+ *
+ * Field elements are eight 32-bit words, kept below 2^256 and reduced mod
+ * p = 2^255 - 19 only to be encoded, 2^256 folding back in as 38. That
+ * comes down to UMULL/UMLAL and carries on Cortex-M3/M4. Nothing secret
+ * goes through verification, so [S]B - [h]A is taken in a single pass
+ * over both scalars, adding B, -A or B - A as their bits tell. */
+
+#include "ed25519.h"
+
+#include <string.h>
+
+typedef uint32_t fe[8];
+
+struct point {
+	fe x, y, z, t; /* extended coordinates, T = XY/Z */
+};
+
+struct sha512 {
+	uint64_t h[8];
+	uint64_t len;
+	uint8_t buf[128];
+	size_t n;
+};
+
+static const fe fe_d = {
+	0x135978a3, 0x75eb4dca, 0x4141d8ab, 0x00700a4d,
+	0x7779e898, 0x8cc74079, 0x2b6ffe73, 0x52036cee,
+};
+static const fe fe_d2 = {
+	0x26b2f159, 0xebd69b94, 0x8283b156, 0x00e0149a,
+	0xeef3d130, 0x198e80f2, 0x56dffce7, 0x2406d9dc,
+};
+static const fe fe_sqrtm1 = {
+	0x4a0ea0b0, 0xc4ee1b27, 0xad2fe478, 0x2f431806,
+	0x3dfbd7a7, 0x2b4d0099, 0x4fc1df0b, 0x2b832480,
+};
+static const fe fe_one = { 1, };
+static const fe fe_zero = { 0, };
+
+static const struct point base = {
+	.x = {	0x8f25d51a, 0xc9562d60, 0x9525a7b2, 0x692cc760,
+		0xfdd6dc5c, 0xc0a4e231, 0xcd6e53fe, 0x216936d3, },
+	.y = {	0x66666658, 0x66666666, 0x66666666, 0x66666666,
+		0x66666666, 0x66666666, 0x66666666, 0x66666666, },
+	.z = {	1, },
+	.t = {	0xa5b7dda3, 0x6dde8ab3, 0x775152f5, 0x20f09f80,
+		0x64abe37d, 0x66ea4e8e, 0xd78b7665, 0x67875f0f, },
+};
+
+/* the group order, little endian */
+static const uint8_t order[32] = {
+	0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+	0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x10,
+};
+
+static const uint64_t k512[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+	0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+	0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+	0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+	0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+	0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+	0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+	0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+	0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+	0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+	0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+	0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+	0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+	0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+/* Adds c times 2^256, that is c times 38 */
+static void fe_fold(fe r, uint64_t c)
+{
+	c *= 38;
+	for (int i = 0; i < 8; i++) {
+		c += r[i];
+		r[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	r[0] += (uint32_t)c * 38; /* wrapped around, so r[0] is small */
+}
+
+static void fe_add(fe r, const fe a, const fe b)
+{
+	uint64_t c = 0;
+
+	for (int i = 0; i < 8; i++) {
+		c += (uint64_t)a[i] + b[i];
+		r[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	fe_fold(r, c);
+}
+
+static void fe_sub(fe r, const fe a, const fe b)
+{
+	int64_t c = 0;
+
+	for (int i = 0; i < 8; i++) {
+		c += (int64_t)a[i] - b[i];
+		r[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	/* a borrow of 2^256 has 38 too many */
+	c *= 38;
+	for (int i = 0; i < 8; i++) {
+		c += r[i];
+		r[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	r[0] -= (uint32_t)-c * 38; /* wrapped around, so r[0] is large */
+}
+
+static void fe_mul(fe r, const fe a, const fe b)
+{
+	uint32_t t[16];
+	uint64_t c;
+
+	memset(t, 0, sizeof(t));
+	for (int i = 0; i < 8; i++) {
+		c = 0;
+		for (int j = 0; j < 8; j++) {
+			c += (uint64_t)a[i] * b[j] + t[i + j];
+			t[i + j] = (uint32_t)c;
+			c >>= 32;
+		}
+		t[i + 8] = (uint32_t)c;
+	}
+
+	c = 0;
+	for (int i = 0; i < 8; i++) {
+		c += (uint64_t)t[i + 8] * 38 + t[i];
+		r[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	fe_fold(r, c);
+}
+
+static void fe_sq(fe r, const fe a)
+{
+	fe_mul(r, a, a);
+}
+
+static void fe_unpack(fe r, const uint8_t *s)
+{
+	for (int i = 0; i < 8; i++)
+		r[i] = (uint32_t)s[i * 4] | (uint32_t)s[i * 4 + 1] << 8
+			| (uint32_t)s[i * 4 + 2] << 16
+			| (uint32_t)s[i * 4 + 3] << 24;
+	r[7] &= 0x7fffffff;
+}
+
+static void fe_pack(uint8_t *s, const fe a)
+{
+	fe t, u;
+	uint64_t c;
+
+	/* bit 255 folded in as 19, twice to get below 2^255 for sure */
+	memcpy(t, a, sizeof(t));
+	for (int n = 0; n < 2; n++) {
+		c = (uint64_t)(t[7] >> 31) * 19;
+		t[7] &= 0x7fffffff;
+		for (int i = 0; i < 8; i++) {
+			c += t[i];
+			t[i] = (uint32_t)c;
+			c >>= 32;
+		}
+	}
+
+	/* and p taken off when t + 19 reaches 2^255 */
+	c = 19;
+	for (int i = 0; i < 8; i++) {
+		c += t[i];
+		u[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	if (u[7] >> 31) {
+		u[7] &= 0x7fffffff;
+		memcpy(t, u, sizeof(t));
+	}
+
+	for (int i = 0; i < 32; i++)
+		s[i] = (uint8_t)(t[i / 4] >> (i % 4 * 8));
+}
+
+static int fe_equal(const fe a, const fe b)
+{
+	uint8_t x[32], y[32];
+
+	fe_pack(x, a);
+	fe_pack(y, b);
+
+	return !memcmp(x, y, sizeof(x));
+}
+
+static int fe_parity(const fe a)
+{
+	uint8_t s[32];
+
+	fe_pack(s, a);
+
+	return s[0] & 1;
+}
+
+/* a^(p - 2) */
+static void fe_invert(fe r, const fe a)
+{
+	fe c;
+
+	memcpy(c, a, sizeof(c));
+	for (int i = 253; i >= 0; i--) {
+		fe_sq(c, c);
+		if (i != 2 && i != 4)
+			fe_mul(c, c, a);
+	}
+	memcpy(r, c, sizeof(c));
+}
+
+/* a^((p - 5) / 8) */
+static void fe_pow2523(fe r, const fe a)
+{
+	fe c;
+
+	memcpy(c, a, sizeof(c));
+	for (int i = 250; i >= 0; i--) {
+		fe_sq(c, c);
+		if (i != 1)
+			fe_mul(c, c, a);
+	}
+	memcpy(r, c, sizeof(c));
+}
+
+static void point_add(struct point *r, const struct point *q)
+{
+	fe a, b, c, d, t, e, f, g, h;
+
+	fe_sub(a, r->y, r->x);
+	fe_sub(t, q->y, q->x);
+	fe_mul(a, a, t);
+	fe_add(b, r->x, r->y);
+	fe_add(t, q->x, q->y);
+	fe_mul(b, b, t);
+	fe_mul(c, r->t, q->t);
+	fe_mul(c, c, fe_d2);
+	fe_mul(d, r->z, q->z);
+	fe_add(d, d, d);
+	fe_sub(e, b, a);
+	fe_sub(f, d, c);
+	fe_add(g, d, c);
+	fe_add(h, b, a);
+	fe_mul(r->x, e, f);
+	fe_mul(r->y, h, g);
+	fe_mul(r->z, g, f);
+	fe_mul(r->t, e, h);
+}
+
+static void point_double(struct point *r)
+{
+	fe a, b, c, e, f, g, h;
+
+	fe_sq(a, r->x);
+	fe_sq(b, r->y);
+	fe_sq(c, r->z);
+	fe_add(c, c, c);
+	fe_add(h, a, b);
+	fe_add(e, r->x, r->y);
+	fe_sq(e, e);
+	fe_sub(e, h, e);
+	fe_sub(g, a, b);
+	fe_add(f, c, g);
+	fe_mul(r->x, e, f);
+	fe_mul(r->y, g, h);
+	fe_mul(r->z, f, g);
+	fe_mul(r->t, e, h);
+}
+
+static void point_identity(struct point *r)
+{
+	memcpy(r->x, fe_zero, sizeof(fe));
+	memcpy(r->y, fe_one, sizeof(fe));
+	memcpy(r->z, fe_one, sizeof(fe));
+	memcpy(r->t, fe_zero, sizeof(fe));
+}
+
+static void point_negate(struct point *r)
+{
+	fe_sub(r->x, fe_zero, r->x);
+	fe_sub(r->t, fe_zero, r->t);
+}
+
+static void point_pack(uint8_t *s, const struct point *p)
+{
+	fe zi, x, y;
+
+	fe_invert(zi, p->z);
+	fe_mul(x, p->x, zi);
+	fe_mul(y, p->y, zi);
+	fe_pack(s, y);
+	s[31] ^= (uint8_t)(fe_parity(x) << 7);
+}
+
+/* x recovered from y and its sign, RFC 8032 5.1.3 */
+static int point_unpack(struct point *r, const uint8_t *s)
+{
+	fe u, v, v3, t, chk;
+
+	fe_unpack(r->y, s);
+	memcpy(r->z, fe_one, sizeof(fe));
+
+	fe_sq(u, r->y);
+	fe_mul(v, u, fe_d);
+	fe_sub(u, u, fe_one); /* y^2 - 1 */
+	fe_add(v, v, fe_one); /* d y^2 + 1 */
+
+	/* x = u v^3 (u v^7)^((p - 5) / 8) */
+	fe_sq(v3, v);
+	fe_mul(v3, v3, v);
+	fe_sq(t, v3);
+	fe_mul(t, t, v);
+	fe_mul(t, t, u);
+	fe_pow2523(t, t);
+	fe_mul(t, t, v3);
+	fe_mul(r->x, t, u);
+
+	fe_sq(chk, r->x);
+	fe_mul(chk, chk, v);
+	if (!fe_equal(chk, u)) {
+		fe_mul(r->x, r->x, fe_sqrtm1);
+		fe_sq(chk, r->x);
+		fe_mul(chk, chk, v);
+		if (!fe_equal(chk, u))
+			return -1;
+	}
+
+	if (fe_parity(r->x) != s[31] >> 7) {
+		if (fe_equal(r->x, fe_zero))
+			return -1;
+		fe_sub(r->x, fe_zero, r->x);
+	}
+	fe_mul(r->t, r->x, r->y);
+
+	return 0;
+}
+
+static uint64_t ror64(uint64_t x, int n)
+{
+	return (x >> n) | (x << (64 - n));
+}
+
+static void sha512_block(uint64_t *h, const uint8_t *p)
+{
+	uint64_t w[16], s[8], t1, t2;
+
+	memcpy(s, h, sizeof(s));
+	for (int i = 0; i < 80; i++) {
+		if (i < 16) {
+			w[i] = 0;
+			for (int j = 0; j < 8; j++)
+				w[i] = (w[i] << 8) | p[i * 8 + j];
+		} else {
+			uint64_t a = w[(i + 1) & 15], b = w[(i + 14) & 15];
+
+			w[i & 15] += (ror64(a, 1) ^ ror64(a, 8) ^ (a >> 7))
+				+ (ror64(b, 19) ^ ror64(b, 61) ^ (b >> 6))
+				+ w[(i + 9) & 15];
+		}
+		t1 = s[7] + (ror64(s[4], 14) ^ ror64(s[4], 18)
+				^ ror64(s[4], 41))
+			+ (s[6] ^ (s[4] & (s[5] ^ s[6]))) + k512[i] + w[i & 15];
+		t2 = (ror64(s[0], 28) ^ ror64(s[0], 34) ^ ror64(s[0], 39))
+			+ ((s[0] & s[1]) | (s[2] & (s[0] | s[1])));
+		memmove(&s[1], &s[0], sizeof(s[0]) * 7);
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; i++)
+		h[i] += s[i];
+}
+
+static void sha512_init(struct sha512 *c)
+{
+	static const uint64_t iv[8] = {
+		0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+		0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+		0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+		0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+	};
+
+	memcpy(c->h, iv, sizeof(iv));
+	c->len = 0;
+	c->n = 0;
+}
+
+static void sha512_update(struct sha512 *c, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	c->len += len;
+	while (len--) {
+		c->buf[c->n++] = *p++;
+		if (c->n == sizeof(c->buf)) {
+			sha512_block(c->h, c->buf);
+			c->n = 0;
+		}
+	}
+}
+
+static void sha512_final(struct sha512 *c, uint8_t *digest)
+{
+	uint64_t bits = c->len << 3;
+
+	c->buf[c->n++] = 0x80;
+	if (c->n > sizeof(c->buf) - 16) {
+		memset(&c->buf[c->n], 0, sizeof(c->buf) - c->n);
+		sha512_block(c->h, c->buf);
+		c->n = 0;
+	}
+	memset(&c->buf[c->n], 0, sizeof(c->buf) - c->n);
+	for (int i = 0; i < 8; i++)
+		c->buf[127 - i] = (uint8_t)(bits >> (i * 8));
+	sha512_block(c->h, c->buf);
+
+	for (int i = 0; i < 64; i++)
+		digest[i] = (uint8_t)(c->h[i / 8] >> (56 - i % 8 * 8));
+}
+
+/* x, in bytes of any size up to 64 limbs, mod the group order into r */
+static void scalar_reduce(uint8_t *r, int64_t *x)
+{
+	int64_t carry;
+	int i, j;
+
+	for (i = 63; i >= 32; i--) {
+		carry = 0;
+		for (j = i - 32; j < i - 12; j++) {
+			x[j] += carry - 16 * x[i] * order[j - (i - 32)];
+			carry = (x[j] + 128) >> 8;
+			x[j] -= carry * 256;
+		}
+		x[j] += carry;
+		x[i] = 0;
+	}
+
+	carry = 0;
+	for (j = 0; j < 32; j++) {
+		x[j] += carry - (x[31] >> 4) * order[j];
+		carry = x[j] >> 8;
+		x[j] &= 255;
+	}
+	for (j = 0; j < 32; j++)
+		x[j] -= carry * order[j];
+	for (i = 0; i < 32; i++) {
+		x[i + 1] += x[i] >> 8;
+		r[i] = (uint8_t)(x[i] & 255);
+	}
+}
+
+static void hash_reduce(uint8_t *r, const uint8_t *a, const uint8_t *b,
+		const uint8_t *msg, size_t len)
+{
+	struct sha512 c;
+	uint8_t h[64];
+	int64_t x[64];
+
+	sha512_init(&c);
+	sha512_update(&c, a, 32);
+	sha512_update(&c, b, 32);
+	sha512_update(&c, msg, len);
+	sha512_final(&c, h);
+
+	for (int i = 0; i < 64; i++)
+		x[i] = h[i];
+	scalar_reduce(r, x);
+}
+
+/* S has to be below the group order not to be malleable */
+static int scalar_canonical(const uint8_t *s)
+{
+	for (int i = 31; i >= 0; i--) {
+		if (s[i] != order[i])
+			return s[i] < order[i];
+	}
+
+	return 0;
+}
+
+static int bit(const uint8_t *s, int i)
+{
+	return (s[i >> 3] >> (i & 7)) & 1;
+}
+
+int ed25519_verify(const uint8_t *sig, const uint8_t *msg, size_t len,
+		const uint8_t *pub)
+{
+	struct point r, q[4];
+	uint8_t h[32], check[32];
+
+	if (!scalar_canonical(&sig[32]) || point_unpack(&q[2], pub))
+		return -1;
+
+	hash_reduce(h, sig, pub, msg, len);
+
+	/* [S]B + [h](-A), both scalars below 2^253 */
+	point_negate(&q[2]);
+	q[1] = base;
+	q[3] = base;
+	point_add(&q[3], &q[2]);
+
+	point_identity(&r);
+	for (int i = 252; i >= 0; i--) {
+		int n = bit(&sig[32], i) | bit(h, i) << 1;
+
+		point_double(&r);
+		if (n)
+			point_add(&r, &q[n]);
+	}
+
+	point_pack(check, &r);
+
+	return memcmp(check, sig, sizeof(check))? -1 : 0;
+}
+
+#if defined(HOST)
+static void scalarmult_base(struct point *r, const uint8_t *s)
+{
+	point_identity(r);
+	for (int i = 255; i >= 0; i--) {
+		point_double(r);
+		if (bit(s, i))
+			point_add(r, &base);
+	}
+}
+
+static void expand(uint8_t *h, const uint8_t *seed)
+{
+	struct sha512 c;
+
+	sha512_init(&c);
+	sha512_update(&c, seed, 32);
+	sha512_final(&c, h);
+	h[0] &= 248;
+	h[31] &= 127;
+	h[31] |= 64;
+}
+
+void ed25519_pubkey(uint8_t *pub, const uint8_t *seed)
+{
+	struct point a;
+	uint8_t h[64];
+
+	expand(h, seed);
+	scalarmult_base(&a, h);
+	point_pack(pub, &a);
+}
+
+void ed25519_sign(uint8_t *sig, const uint8_t *msg, size_t len,
+		const uint8_t *seed)
+{
+	struct sha512 c;
+	struct point p;
+	uint8_t h[64], pub[32], r[64], k[32];
+	int64_t x[64];
+
+	expand(h, seed);
+	scalarmult_base(&p, h);
+	point_pack(pub, &p);
+
+	sha512_init(&c);
+	sha512_update(&c, &h[32], 32);
+	sha512_update(&c, msg, len);
+	sha512_final(&c, r);
+	for (int i = 0; i < 64; i++)
+		x[i] = r[i];
+	scalar_reduce(r, x);
+
+	scalarmult_base(&p, r);
+	point_pack(sig, &p);
+
+	hash_reduce(k, sig, pub, msg, len);
+
+	memset(x, 0, sizeof(x));
+	for (int i = 0; i < 32; i++)
+		x[i] = r[i];
+	for (int i = 0; i < 32; i++)
+		for (int j = 0; j < 32; j++)
+			x[i + j] += (int64_t)k[i] * h[j];
+	scalar_reduce(&sig[32], x);
+}
+#endif /* HOST */
+#endif /* ED25519 || HOST */
@@ -0,0 +1,22 @@
+#ifndef __ED25519_H__
+#define __ED25519_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ED25519_KEY_SIZE		32
+#define ED25519_SIG_SIZE		64
+
+/* Returns 0 when `sig` is a valid RFC 8032 signature of `msg` by `pub`.
+ * The image digest is what gets signed, not the image itself. */
+int ed25519_verify(const uint8_t *sig, const uint8_t *msg, size_t len,
+		const uint8_t *pub);
+
+#if defined(HOST)
+/* Signing side, for the host tools only: not constant time */
+void ed25519_pubkey(uint8_t *pub, const uint8_t *seed);
+void ed25519_sign(uint8_t *sig, const uint8_t *msg, size_t len,
+		const uint8_t *seed);
+#endif
+
+#endif /* __ED25519_H__ */
@@ -23,9 +23,18 @@
 #include "bsp.h"
 #include "flash.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
+#if !defined(FLASH_ROW_SIZE)
+#define FLASH_ROW_SIZE			256 /* bytes checked and read back at once */
+#endif
+#if !defined(FLASH_RMW_SIZE)
+#define FLASH_RMW_SIZE			2048 /* sectors merged in RAM, up to */
+#endif
+
 static inline void clear_flags()
 {
 	FLASH_SR |= FLASH_STATUS_MASK;
@@ -41,9 +50,14 @@ static inline int get_errflags()
 	return FLASH_SR & FLASH_STATUS_ERROR_MASK;
 }
 
+static void (*idle)(void);
+
 static inline void flash_wait()
 {
-	while (FLASH_SR & (1U << BIT_FLASH_BUSY));
+	while (FLASH_SR & (1U << BIT_FLASH_BUSY)) {
+		if (idle)
+			idle();
+	}
 }
 
 static inline void flash_unlock()
@@ -69,11 +83,53 @@ static inline void flash_unlock_opt()
 	FLASH_OPTKEYR = FLASH_OPT_UNLOCK_KEY2;
 }
 
+/* An erase flash_erase_start() left running, done with by ISR_flash() or
+ * by whatever needs the flash next, whichever gets to it first */
+static volatile int erasing;
+
+static inline void erase_done()
+{
+	FLASH_CR &= ~((1U << BIT_FLASH_END_OP_INT) |
+			(1U << BIT_FLASH_ERR_INT) |
+			(1U << BIT_FLASH_SECTOR_ERASE) |
+			(1U << BIT_FLASH_PROGRAM));
+	NVIC_ICER(FLASH_IRQ / 32) = 1U << (FLASH_IRQ % 32);
+	clear_flags();
+	FLASH_CR |= 1U << BIT_FLASH_LOCK;
+	erasing = 0;
+}
+
+static inline int erase_poll()
+{
+	if (!erasing)
+		return 0;
+
+	cli();
+	if (erasing && !(FLASH_SR & (1U << BIT_FLASH_BUSY)))
+		erase_done();
+	sei();
+
+	return erasing;
+}
+
+static inline void flash_settle()
+{
+	while (erase_poll()) {
+		if (idle)
+			idle();
+	}
+}
+
+/* Interrupts stay masked from here to flash_finish(): one taken while the
+ * flash is busy would have the core stall fetching the vector from it until
+ * the program or erase is done, the idle hook not running meanwhile. */
 static inline void flash_prepare()
 {
+	flash_settle();
+	cli();
 	clear_flags();
 	flash_unlock();
-	flash_writesize_set(32);
+	flash_writesize_set(FLASH_PSIZE);
 	FLASH_CR |= 1U << BIT_FLASH_PROGRAM;
 	flash_wait();
 }
@@ -82,10 +138,11 @@ static inline void flash_finish()
 {
 	FLASH_CR &= ~(1U << BIT_FLASH_PROGRAM);
 	flash_lock();
+	sei();
 }
 
 #if defined(stm32f4)
-static inline void flash_erase_sector(int nr)
+static inline void flash_erase_sector_start(int nr)
 {
 	unsigned int tmp;
 
@@ -94,12 +151,17 @@ static inline void flash_erase_sector(int nr)
 	if (nr >= 12)
 		nr = (nr - 12) | 0x10;
 
+	flash_writesize_set(FLASH_PSIZE); /* erase time goes with it too */
 	tmp = FLASH_CR;
 	tmp &= ~(0x1f << BIT_FLASH_SECTOR_NR);
 	tmp |= (1U << BIT_FLASH_SECTOR_ERASE) | (nr << BIT_FLASH_SECTOR_NR);
 	tmp |= 1U << BIT_FLASH_START;
 	FLASH_CR = tmp;
+}
 
+static inline void flash_erase_sector(int nr)
+{
+	flash_erase_sector_start(nr);
 	flash_wait();
 
 	debug("erase sector %d", nr);
@@ -111,6 +173,7 @@ static inline void flash_erase_all()
 
 	flash_wait();
 
+	flash_writesize_set(FLASH_PSIZE);
 	tmp = FLASH_CR;
 	tmp |= (1U << BIT_FLASH_MASS_ERASE) | (1U << BIT_FLASH_MASS_ERASE2);
 	tmp |= 1U << BIT_FLASH_START;
@@ -121,15 +184,60 @@ static inline void flash_erase_all()
 	debug("erase all banks and sectors");
 }
 
-static inline bool flash_write_word(unsigned int *dst, const unsigned int *src)
+/* Each write has to be of the size PSIZE is set to. A double word goes in
+ * as two words, the first one at the lower address, and the half of one
+ * outside the row is written all ones, which leaves it as it is. */
+static inline void flash_store_row(unsigned int *dst, const unsigned int *src,
+		size_t n)
 {
-	*dst = *(volatile unsigned int *)src;
-	flash_wait();
+#if FLASH_PSIZE == 64
+	volatile unsigned int *p = dst;
+	size_t i = 0;
+
+	if ((uintptr_t)p & 4) {
+		p[-1] = 0xffffffffU;
+		isb();
+		p[0] = src[0];
+		i = 1;
+	}
+	for (; i + 1 < n; i += 2) {
+		flash_wait();
+		p[i] = src[i];
+		isb();
+		p[i + 1] = src[i + 1];
+	}
+	if (i < n) {
+		flash_wait();
+		p[i] = src[i];
+		isb();
+		p[i + 1] = 0xffffffffU;
+	}
+#elif FLASH_PSIZE == 32
+	volatile unsigned int *p = dst;
 
-	if (get_errflags() || *(volatile unsigned int *)dst != *src)
-		return false;
+	for (size_t i = 0; i < n; i++) {
+		flash_wait();
+		p[i] = src[i];
+	}
+#elif FLASH_PSIZE == 16
+	volatile unsigned short int *p = (volatile unsigned short int *)dst;
+	const unsigned short int *q = (const unsigned short int *)src;
+
+	for (size_t i = 0; i < n * 2; i++) {
+		flash_wait();
+		p[i] = q[i];
+	}
+#elif FLASH_PSIZE == 8
+	volatile unsigned char *p = (volatile unsigned char *)dst;
+	const unsigned char *q = (const unsigned char *)src;
 
-	return true;
+	for (size_t i = 0; i < n * 4; i++) {
+		flash_wait();
+		p[i] = q[i];
+	}
+#else
+#error FLASH_PSIZE must be one of 8, 16, 32 and 64
+#endif
 }
 #elif defined(stm32f1) || defined(stm32f3)
 static inline void flash_erase_sector(int addr)
@@ -159,22 +267,18 @@ static inline void flash_erase_all()
 	FLASH_CR |= 1U << BIT_FLASH_PROGRAM;
 }
 
-static inline bool flash_write_word(unsigned int *dst, const unsigned int *src)
+/* Half-words only, anything else being a bus error */
+static inline void flash_store_row(unsigned int *dst, const unsigned int *src,
+		size_t n)
 {
-	unsigned int addr = (unsigned int)dst;
-	unsigned short int t;
-
-	t = (unsigned short int)*src;
-	*(volatile unsigned short int *)(addr) = t;
-	flash_wait();
-	t = (unsigned short int)(*src >> 16);
-	*(volatile unsigned short int *)(addr+2) = (unsigned short int)(*src >> 16);
-	flash_wait();
-
-	if (get_errflags() || *(volatile unsigned int *)dst != *src)
-		return false;
+	volatile unsigned short int *p = (volatile unsigned short int *)dst;
 
-	return true;
+	for (size_t i = 0; i < n; i++) {
+		flash_wait();
+		p[i * 2] = (unsigned short int)src[i];
+		flash_wait();
+		p[i * 2 + 1] = (unsigned short int)(src[i] >> 16);
+	}
 }
 #else
 #error undefined machine
@@ -199,15 +303,163 @@ static inline int flash_erase(int nr)
 	return get_errflags();
 }
 
+/* Programs `n` words a unit at a time, each written once the flash is done
+ * with the one before, the idle hook draining the UART meanwhile: a write
+ * while the flash is busy would stall the bus, and the core with it, for a
+ * whole program time, 52.5us a half-word on F1 against 87us a byte at
+ * 115200. Then checks the flags and reads the row back once. A row already
+ * holding the words is left alone. Returns how many words made it, from
+ * the start. */
+static size_t __attribute__((section(".iap")))
+flash_write_row(unsigned int *dst, const unsigned int *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && dst[i] == src[i]; i++)
+		;
+	if (i == n) /* already there */
+		return n;
+
+	flash_store_row(dst, src, n);
+	flash_wait();
+
+	for (i = 0; i < n; i++) {
+		if (((volatile unsigned int *)dst)[i] != src[i])
+			break;
+	}
+
+	if (get_errflags() && i == n)
+		i = 0; /* the whole row, not knowing which one */
+
+	return i;
+}
+
+/* Scratch sectors for flash_write_core() to save a sector in before erasing
+ * it come out of a map of the free ones, a bit each, set for a sector found
+ * erased by one scan of _scratch, the end of the flash no image reaches, the
+ * first time one is needed, and scanned again only once the map runs dry.
+ * The next one is taken from where the last one was, one of the same size
+ * first, and is erased again once done with, so the wear goes round all of
+ * them rather than one sector. A sector is checked to be still erased when
+ * taken, as anything may have been programmed since the scan. */
+extern char _scratch, _rom_start, _rom_size;
+
+static unsigned int scratch_map[(FLASH_MAP_SIZE + 31) / 32];
+static unsigned int scratch_next;
+
+static inline int is_blank(const unsigned int *p, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (p[i] != 0xffffffffU)
+			return 0;
+	}
+
+	return 1;
+}
+
+static inline unsigned int scratch_addr(unsigned int u)
+{
+	return (unsigned int)&_rom_start + u * FLASH_MAP_UNIT;
+}
+
+static inline unsigned int scratch_unit(unsigned int addr)
+{
+	return (addr - (unsigned int)&_rom_start) / FLASH_MAP_UNIT;
+}
+
+static void __attribute__((section(".iap"))) scratch_scan(void)
+{
+	unsigned int p, end, u;
+	int ss;
+
+	p = (unsigned int)&_scratch;
+	end = (unsigned int)&_rom_start + (unsigned int)&_rom_size;
+
+	for (; p < end; p = BASE_ALIGN(p, ss) + ss) {
+		if (!(ss = get_sector_size_kb(addr2sector((void *)p)) << 10))
+			break;
+		if ((u = scratch_unit(p)) >= FLASH_MAP_SIZE)
+			break;
+		if (p == BASE_ALIGN(p, ss) &&
+				is_blank((const unsigned int *)p, ss / 4))
+			scratch_map[u / 32] |= 1U << (u % 32);
+	}
+}
+
+static unsigned int __attribute__((section(".iap")))
+find_scratch_sector(int size, unsigned int avoid, int exact)
+{
+	unsigned int u, k, p;
+	int ss;
+
+	for (k = 0; k < FLASH_MAP_SIZE; k++) {
+		u = (scratch_next + k) % FLASH_MAP_SIZE;
+		if (!(scratch_map[u / 32] & (1U << (u % 32))))
+			continue;
+		p = scratch_addr(u);
+		ss = get_sector_size_kb(addr2sector((void *)p)) << 10;
+		if (p == avoid || ss < size || (exact && ss != size))
+			continue;
+		if (!is_blank((const unsigned int *)p, (size_t)ss / 4)) {
+			scratch_map[u / 32] &= ~(1U << (u % 32));
+			continue;
+		}
+		return p;
+	}
+
+	return 0;
+}
+
+/* A free sector of `size` bytes at least, other than the one at `avoid`,
+ * or 0 if there is none */
+static unsigned int __attribute__((section(".iap")))
+get_scratch_sector(int size, unsigned int avoid)
+{
+	unsigned int p, u;
+
+	if (!(p = find_scratch_sector(size, avoid, 1)) &&
+			!(p = find_scratch_sector(size, avoid, 0))) {
+		scratch_scan();
+		if (!(p = find_scratch_sector(size, avoid, 1)))
+			p = find_scratch_sector(size, avoid, 0);
+	}
+
+	if (p) {
+		u = scratch_unit(p);
+		scratch_map[u / 32] &= ~(1U << (u % 32));
+		scratch_next = u + 1;
+	}
+
+	return p;
+}
+
+static void __attribute__((section(".iap")))
+put_scratch_sector(unsigned int addr)
+{
+	unsigned int u = scratch_unit(addr);
+
+	flash_prepare();
+	if (!flash_erase(addr2sector((void *)addr)))
+		scratch_map[u / 32] |= 1U << (u % 32);
+	flash_finish();
+}
+
+#if FLASH_RMW_SIZE > 0
+/* A sector small enough is read into RAM, what is to be written merged in,
+ * and programmed back whole once erased, without going through flash */
+static unsigned int rmw_buf[FLASH_RMW_SIZE / 4];
+#endif
+
 static size_t __attribute__((section(".iap")))
 flash_write_core(void * const addr, const void * const buf, size_t len,
 		bool overwrite)
 {
-	const unsigned int *src, *new, *restore;
+	const unsigned int *src, *new, *restore, **from;
 	unsigned int *dst;
-	unsigned int base, tmp;
+	unsigned int base, tmp, end;
 	int s, ss, diff, left, t;
 	unsigned int new_start, new_end;
+	size_t n, done;
 
 	len = (len / 4) + !!(len % 4); /* bytes to word */
 	left = len;
@@ -217,28 +469,34 @@ flash_write_core(void * const addr, const void * const buf, size_t len,
 	new = NULL;
 	new_start = new_end = 0;
 	restore = NULL;
+	tmp = 0;
 
 	flash_prepare();
 retry:
 	while (left) {
 		if ((unsigned int)dst >= new_start &&
 				(unsigned int)dst < new_end) {
-			if (!flash_write_word(dst, new))
-				break;
-			new++;
+			from = &new;
+			n = (new_end - (unsigned int)dst) / 4;
 			diff = 0;
 		} else if (diff < 0) { /* Restore the fore data */
-			if (!flash_write_word(dst, restore))
-				break;
-			restore++;
+			from = &restore;
+			n = (new_start - (unsigned int)dst) / 4;
 		} else {
-			if (!flash_write_word(dst, src))
-				break;
-			src++;
+			from = &src;
+			n = (unsigned int)dst < new_start?
+				(new_start - (unsigned int)dst) / 4 : len;
 		}
+		n = min(n, (size_t)left);
+		n = min(n, (size_t)FLASH_ROW_SIZE / 4);
+
+		done = flash_write_row(dst, *from, n);
+		*from += done;
+		dst += done;
+		left -= (int)done;
 
-		dst++;
-		left--;
+		if (done < n)
+			break;
 	}
 
 	if (left) {
@@ -262,8 +520,36 @@ retry:
 		src = new + (new_end - new_start) / 4;
 		left += abs(diff);
 
-		if (!overwrite) { /* Save the sector in a temporal sector */
-			tmp = get_temporal_sector_addr(ss);
+#if FLASH_RMW_SIZE > 0
+		if (!overwrite && ss <= FLASH_RMW_SIZE) {
+			end = (unsigned int)addr + len * 4;
+			new_start = (unsigned int)addr > base?
+				(unsigned int)addr : base;
+			new_end = min(end, base + ss);
+			memcpy(rmw_buf, (const void *)base, (size_t)ss);
+			memcpy((uint8_t *)rmw_buf + (new_start - base),
+					(const uint8_t *)buf
+					+ (new_start - (unsigned int)addr),
+					new_end - new_start);
+			src = (const unsigned int *)buf
+				+ (new_end - (unsigned int)addr) / 4;
+			left = (int)((unsigned int)ss + end - new_end) / 4;
+			new = rmw_buf;
+			new_start = base;
+			new_end = base + ss;
+			diff = 0;
+
+			flash_prepare();
+			if (flash_erase(s))
+				goto cleanout;
+			goto retry;
+		}
+#endif
+		if (!overwrite) { /* Save the sector in a scratch sector */
+			if (tmp)
+				put_scratch_sector(tmp);
+			if (!(tmp = get_scratch_sector(ss, base)))
+				goto cleanout;
 
 			if (flash_write_core((void *)tmp, (void *)base, ss, true) != (size_t)ss)
 				goto out;
@@ -288,6 +574,8 @@ retry:
 cleanout:
 	flash_finish();
 out:
+	if (tmp)
+		put_scratch_sector(tmp);
 	dsb();
 	isb();
 
@@ -303,6 +591,77 @@ size_t flash_program(void * const addr, const void * const buf, size_t len)
 	return written;
 }
 
+size_t flash_update(void * const addr, const void * const buf, size_t len)
+{
+	return flash_write_core(addr, buf, len, 0);
+}
+
+int __attribute__((section(".iap")))
+flash_erase_range(void * const addr, size_t len)
+{
+	unsigned int p, end;
+	int s, ss, err;
+
+	p = (unsigned int)addr;
+	end = p + len;
+	err = 0;
+
+	flash_prepare();
+
+	while (p < end && !err) {
+		s = addr2sector((void *)p);
+		if (!(ss = get_sector_size_kb(s) << 10)) {
+			err = -ERANGE;
+			break;
+		}
+		err = flash_erase(s);
+		p = BASE_ALIGN(p, ss) + ss;
+	}
+
+	flash_finish();
+	dsb();
+	isb();
+
+	return err;
+}
+
+/* Only a sector in the bank other than the one the bootloader runs from is
+ * erased in the background, the CPU going on fetching from its own bank.
+ * Programming is left synchronous: a word takes microseconds and the one
+ * controller serves both banks anyway. */
+int __attribute__((section(".iap"))) flash_erase_start(void * const addr)
+{
+#if defined(stm32f4)
+	int s = addr2sector(addr);
+
+	if (addr2bank(addr) == addr2bank(&_rom_start) ||
+			!get_sector_size_kb(s))
+		return flash_erase_range(addr, 1);
+
+	flash_prepare();
+	FLASH_CR |= (1U << BIT_FLASH_END_OP_INT) | (1U << BIT_FLASH_ERR_INT);
+	flash_erase_sector_start(s);
+	erasing = 1;
+	NVIC_ISER(FLASH_IRQ / 32) = 1U << (FLASH_IRQ % 32);
+	sei(); /* vectors are fetched from the other bank */
+
+	return 0;
+#else
+	return flash_erase_range(addr, 1);
+#endif
+}
+
+void ISR_flash(void)
+{
+	if (erasing && !(FLASH_SR & (1U << BIT_FLASH_BUSY)))
+		erase_done();
+}
+
+void flash_set_idle(void (*fn)(void))
+{
+	idle = fn;
+}
+
 #if 0
 void flash_protect()
 {
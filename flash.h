@@ -5,5 +5,18 @@
 #include <stddef.h>
 
 size_t flash_program(void * const addr, const void * const buf, size_t len);
+/* Same as flash_program() but what else a sector it has to erase holds is
+ * kept, saved in a free sector meanwhile */
+size_t flash_update(void * const addr, const void * const buf, size_t len);
+/* Erases every sector overlapping [addr, addr + len) */
+int flash_erase_range(void * const addr, size_t len);
+/* Starts erasing the sector `addr` is in and returns right away when it is
+ * in the bank the bootloader does not run from, ISR_flash() taking EOP, or
+ * erases it before returning otherwise. Whatever comes next waits for it. */
+int flash_erase_start(void * const addr);
+void ISR_flash(void);
+/* `fn` gets called while waiting for the flash to finish, from RAM, so it
+ * must be in .iap itself not to stall on the flash being busy */
+void flash_set_idle(void (*fn)(void));
 
 #endif /* __FLASH_H__ */
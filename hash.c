@@ -0,0 +1,163 @@
+#if defined(FASTHASH)
+/* SHA-256 laid out for ARMv7-M. Sixteen rounds are unrolled with the
+ * working variables renamed instead of moved, and the message schedule is
+ * a 16-word window, so a block runs in registers and the stack with no
+ * copying between rounds. Rotates become ROR with the shift folded in and
+ * big endian loads LDR and REV. Whole blocks are hashed straight from
+ * where the data is, only what is left over gets buffered. */
+
+#include "hash.h"
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#define S0(x)			(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)			(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)			(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)			(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z)		((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z)		(((x) & (y)) | ((z) & ((x) | (y))))
+
+#define LOAD(i)			(w[i] = load_be32(&in[(i) * 4]))
+#define SCHED(i)		(w[i] += s1(w[((i) + 14) & 15]) + \
+				 w[((i) + 9) & 15] + s0(w[((i) + 1) & 15]))
+
+#define R(a, b, c, d, e, f, g, h, i, W) do { \
+	uint32_t t1 = h + S1(e) + CH(e, f, g) + k[j + (i)] + W(i); \
+	d += t1; \
+	h = t1 + S0(a) + MAJ(a, b, c); \
+} while (0)
+
+#define R16(W) do { \
+	R(a, b, c, d, e, f, g, h, 0, W); \
+	R(h, a, b, c, d, e, f, g, 1, W); \
+	R(g, h, a, b, c, d, e, f, 2, W); \
+	R(f, g, h, a, b, c, d, e, 3, W); \
+	R(e, f, g, h, a, b, c, d, 4, W); \
+	R(d, e, f, g, h, a, b, c, 5, W); \
+	R(c, d, e, f, g, h, a, b, 6, W); \
+	R(b, c, d, e, f, g, h, a, 7, W); \
+	R(a, b, c, d, e, f, g, h, 8, W); \
+	R(h, a, b, c, d, e, f, g, 9, W); \
+	R(g, h, a, b, c, d, e, f, 10, W); \
+	R(f, g, h, a, b, c, d, e, 11, W); \
+	R(e, f, g, h, a, b, c, d, 12, W); \
+	R(d, e, f, g, h, a, b, c, 13, W); \
+	R(c, d, e, f, g, h, a, b, 14, W); \
+	R(b, c, d, e, f, g, h, a, 15, W); \
+} while (0)
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v)); /* unaligned LDR is fine on ARMv7-M */
+	return __builtin_bswap32(v);
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	v = __builtin_bswap32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void compress(uint32_t *iv, const uint8_t *in, size_t nblocks)
+{
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t w[16];
+	int j;
+
+	for (; nblocks; nblocks--, in += HASH_BLOCK_SIZE) {
+		a = iv[0]; b = iv[1]; c = iv[2]; d = iv[3];
+		e = iv[4]; f = iv[5]; g = iv[6]; h = iv[7];
+
+		j = 0;
+		R16(LOAD);
+		for (j = 16; j < 64; j += 16)
+			R16(SCHED);
+
+		iv[0] += a; iv[1] += b; iv[2] += c; iv[3] += d;
+		iv[4] += e; iv[5] += f; iv[6] += g; iv[7] += h;
+	}
+}
+
+void hash_init(struct hash_state *s)
+{
+	static const uint32_t iv0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(s->iv, iv0, sizeof(s->iv));
+	s->bits_hashed = 0;
+	s->leftover_offset = 0;
+}
+
+void hash_update(struct hash_state *s, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	s->bits_hashed += (uint64_t)len << 3;
+
+	if (s->leftover_offset) {
+		n = HASH_BLOCK_SIZE - s->leftover_offset;
+		if (n > len)
+			n = len;
+		memcpy(&s->leftover[s->leftover_offset], p, n);
+		s->leftover_offset += n;
+		p += n;
+		len -= n;
+		if (s->leftover_offset < HASH_BLOCK_SIZE)
+			return;
+		compress(s->iv, s->leftover, 1);
+		s->leftover_offset = 0;
+	}
+
+	n = len / HASH_BLOCK_SIZE;
+	compress(s->iv, p, n);
+	p += n * HASH_BLOCK_SIZE;
+	len -= n * HASH_BLOCK_SIZE;
+
+	memcpy(s->leftover, p, len);
+	s->leftover_offset = len;
+}
+
+void hash_final(struct hash_state *s, uint8_t *digest)
+{
+	size_t n = s->leftover_offset;
+
+	s->leftover[n++] = 0x80;
+	if (n > HASH_BLOCK_SIZE - 8) {
+		memset(&s->leftover[n], 0, HASH_BLOCK_SIZE - n);
+		compress(s->iv, s->leftover, 1);
+		n = 0;
+	}
+	memset(&s->leftover[n], 0, HASH_BLOCK_SIZE - 8 - n);
+	store_be32(&s->leftover[56], (uint32_t)(s->bits_hashed >> 32));
+	store_be32(&s->leftover[60], (uint32_t)s->bits_hashed);
+	compress(s->iv, s->leftover, 1);
+
+	for (int i = 0; i < 8; i++)
+		store_be32(&digest[i * 4], s->iv[i]);
+
+	memset(s, 0, sizeof(*s));
+}
+#endif /* FASTHASH */
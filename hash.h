@@ -0,0 +1,75 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HASH_DIGEST_SIZE		32
+#define HASH_BLOCK_SIZE			64
+
+/* SHA-256 for the images. With FASTHASH defined it is the unrolled one in
+ * hash.c, otherwise tinycrypt's. Either way a state at a block boundary is
+ * the chaining value and the length, which is what the journal keeps. */
+#if defined(FASTHASH)
+struct hash_state {
+	uint32_t iv[8];
+	uint64_t bits_hashed;
+	uint8_t leftover[HASH_BLOCK_SIZE];
+	size_t leftover_offset;
+};
+
+void hash_init(struct hash_state *s);
+void hash_update(struct hash_state *s, const void *data, size_t len);
+void hash_final(struct hash_state *s, uint8_t *digest);
+
+static inline const uint32_t *hash_chain(const struct hash_state *s)
+{
+	return s->iv;
+}
+
+static inline void hash_resume(struct hash_state *s, const uint32_t *iv,
+		uint32_t len)
+{
+	memcpy(s->iv, iv, sizeof(s->iv));
+	s->bits_hashed = (uint64_t)len << 3;
+	s->leftover_offset = 0;
+}
+#else
+#include "tinycrypt/sha256.h"
+
+struct hash_state {
+	struct tc_sha256_state_struct tc;
+};
+
+static inline void hash_init(struct hash_state *s)
+{
+	tc_sha256_init(&s->tc);
+}
+
+static inline void hash_update(struct hash_state *s, const void *data,
+		size_t len)
+{
+	tc_sha256_update(&s->tc, data, len);
+}
+
+static inline void hash_final(struct hash_state *s, uint8_t *digest)
+{
+	tc_sha256_final(digest, &s->tc);
+}
+
+static inline const uint32_t *hash_chain(const struct hash_state *s)
+{
+	return (const uint32_t *)s->tc.iv;
+}
+
+static inline void hash_resume(struct hash_state *s, const uint32_t *iv,
+		uint32_t len)
+{
+	memcpy(s->tc.iv, iv, sizeof(s->tc.iv));
+	s->tc.bits_hashed = (uint64_t)len << 3;
+	s->tc.leftover_offset = 0;
+}
+#endif
+
+#endif /* __HASH_H__ */
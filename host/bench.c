@@ -0,0 +1,1098 @@
+#define _GNU_SOURCE /* posix_openpt() */
+
+#include "emu.h"
+#include "mkimg.h"
+#include "send.h"
+#include "tinycrypt/sha256.h"
+#include "tinycrypt/ctr_mode.h"
+#include "tinycrypt/ecc_dh.h"
+#include "tinycrypt/ecc_dsa.h"
+
+#define main		yaboot_main
+#include "../main.c"
+#undef main
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#if defined(stm32f4)
+#define DEFAULT_CPU_HZ		16000000UL /* HSI */
+#else
+#define DEFAULT_CPU_HZ		8000000UL /* HSI */
+#endif
+
+#define RMW_WRITES		8 /* small writes into the app */
+#define RMW_SIZE		64
+
+struct sample {
+	double host_s;
+	unsigned long long emu_ns;
+	unsigned long long busy_ns;
+};
+
+static struct mkimg_key key;
+static uint8_t *image;
+static unsigned long reset_hz;
+static uintptr_t linked; /* where the app staged is linked to run */
+
+static double host_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void sample_start(struct sample *s)
+{
+	emu_stats_reset();
+	s->emu_ns = emu_stats()->now_ns;
+	s->host_s = host_now();
+}
+
+static void sample_end(struct sample *s)
+{
+	uart_flush(); /* what the op printed is part of it */
+	s->host_s = host_now() - s->host_s;
+	s->emu_ns = emu_stats()->now_ns - s->emu_ns;
+	s->busy_ns = emu_stats()->busy_ns;
+}
+
+static void report(const char *op, size_t len, const struct sample *s,
+		int err)
+{
+	printf("  %-12s %12.0f %12.0f %10.1f %10.1f %s\n", op,
+			(double)len / s->host_s,
+			s->emu_ns? (double)len * 1e9 / (double)s->emu_ns : 0.,
+			(double)s->emu_ns / 1e6,
+			(double)s->busy_ns / 1e6,
+			err? "FAIL" : "");
+}
+
+static void report_erase(void)
+{
+	const struct emu_stats *st = emu_stats();
+	int i, j;
+
+	if (st->mass_erase)
+		printf("  %-12s mass erase x%lu\n", "", st->mass_erase);
+
+	for (i = 0; i < emu_nsectors(); i = j) {
+		for (j = i + 1; j < emu_nsectors() &&
+				st->erase[j] == st->erase[i]; j++)
+			;
+		if (!st->erase[i])
+			continue;
+		if (j - i == 1)
+			printf("  %-12s sector %d (0x%08lx) x%lu\n", "", i,
+					(unsigned long)emu_sector_base(i),
+					st->erase[i]);
+		else
+			printf("  %-12s sector %d-%d (0x%08lx) x%lu\n", "",
+					i, j - 1,
+					(unsigned long)emu_sector_base(i),
+					st->erase[i]);
+	}
+}
+
+/* What the sender saw of a download, any NAK, frame sent again or timeout
+ * being a byte the bootloader lost while the flash had the core stalled. */
+static void report_send(const struct send_stats *st)
+{
+	printf("  %-12s %zu frames, %zu NAK, %zu resent, %zu timeouts\n", "",
+			st->frames, st->naks, st->resent, st->timeouts);
+}
+
+/* The boot timeline as the application finds it in RAM: time spent up to
+ * each phase since the one before, then in each of the operations. */
+static void report_trace(void)
+{
+	static const char *const phases[] = {
+		[TRACE_CLOCK] = "clock", [TRACE_UART] = "uart",
+		[TRACE_PROBE] = "probe", [TRACE_INSTALL] = "install",
+		[TRACE_HEADER] = "header", [TRACE_VERIFY] = "verify",
+		[TRACE_JUMP] = "jump",
+	};
+	static const char *const sums[TRACE_NSUMS] = {
+		"sha", "aes", "sig", "flash", "crc" };
+	const struct trace_block *tb = &trace_block;
+	const struct trace_event *e = tb->event;
+
+	if (tb->magic != TRACE_MAGIC)
+		return;
+
+	printf("  %-12s", "");
+	for (uint32_t i = 1; i < tb->n; i++)
+		printf(" %s %.2f", phases[e[i].phase], (double)(e[i].cycles -
+					e[i - 1].cycles) * 1e3 / e[i - 1].hz);
+	printf(" ms\n  %-12s", "");
+	for (int i = 0; i < TRACE_NSUMS; i++)
+		printf(" %s %.2f", sums[i], tb->sum[i].hz?
+				(double)tb->sum[i].cycles * 1e3 /
+				tb->sum[i].hz : 0.);
+	printf(" ms\n");
+}
+
+static int hash_check(const char *what, const uint8_t *msg, size_t len,
+		const char *hex)
+{
+	struct hash_state s;
+	uint8_t digest[HASH_DIGEST_SIZE];
+	char out[HASH_DIGEST_SIZE * 2 + 1];
+
+	hash_init(&s);
+	hash_update(&s, msg, len);
+	hash_final(&s, digest);
+	for (int i = 0; i < HASH_DIGEST_SIZE; i++)
+		sprintf(&out[i * 2], "%02x", digest[i]);
+
+	if (!strcmp(out, hex))
+		return 0;
+	printf("  sha256 %s: %s\n", what, out);
+	return 1;
+}
+
+/* The hash backend against the FIPS 180-2 known answers, then against
+ * tinycrypt's, which mkimg signs with, for every length up to a few
+ * blocks fed in two pieces split at every point and for a state resumed
+ * at a block boundary as the journal does. */
+static int hash_kat(void)
+{
+	static const char m448[] = "abcdbcdecdefdefgefghfghighijhijk"
+		"ijkljklmklmnlmnomnopnopq";
+	static const char m896[] = "abcdefghbcdefghicdefghijdefghijk"
+		"efghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqr"
+		"lmnopqrsmnopqrstnopqrstu";
+	struct tc_sha256_state_struct ref;
+	struct hash_state s;
+	uint8_t msg[200], a[HASH_DIGEST_SIZE], b[HASH_DIGEST_SIZE];
+	uint8_t *mil;
+	int fails = 0;
+
+	fails += hash_check("empty", (const uint8_t *)"", 0,
+			"e3b0c44298fc1c149afbf4c8996fb924"
+			"27ae41e4649b934ca495991b7852b855");
+	fails += hash_check("abc", (const uint8_t *)"abc", 3,
+			"ba7816bf8f01cfea414140de5dae2223"
+			"b00361a396177a9cb410ff61f20015ad");
+	fails += hash_check("448 bits", (const uint8_t *)m448,
+			sizeof(m448) - 1,
+			"248d6a61d20638b8e5c026930c3e6039"
+			"a33ce45964ff2167f6ecedd419db06c1");
+	fails += hash_check("896 bits", (const uint8_t *)m896,
+			sizeof(m896) - 1,
+			"cf5b16a778af8380036ce59e7b049237"
+			"0b249b11e8f07a51afac45037afee9d1");
+	if ((mil = malloc(1000000)) == NULL)
+		return 1;
+	memset(mil, 'a', 1000000);
+	fails += hash_check("million a", mil, 1000000,
+			"cdc76e5c9914fb9281a1c7e284d73e67"
+			"f1809a48a497200e046d39ccc7112cd0");
+	free(mil);
+
+	for (size_t i = 0; i < sizeof(msg); i++)
+		msg[i] = (uint8_t)(i * 167 + 13);
+
+	for (size_t len = 0; len <= sizeof(msg); len++) {
+		tc_sha256_init(&ref);
+		tc_sha256_update(&ref, msg, len);
+		tc_sha256_final(a, &ref);
+
+		for (size_t cut = 0; cut <= len; cut++) {
+			hash_init(&s);
+			hash_update(&s, msg, cut);
+			if (cut % HASH_BLOCK_SIZE == 0) {
+				uint32_t iv[8];
+
+				memcpy(iv, hash_chain(&s), sizeof(iv));
+				hash_init(&s);
+				hash_resume(&s, iv, (uint32_t)cut);
+			}
+			hash_update(&s, &msg[cut], len - cut);
+			hash_final(&s, b);
+			if (memcmp(a, b, sizeof(a))) {
+				printf("  sha256 %zu bytes cut at %zu: "
+						"mismatch\n", len, cut);
+				fails++;
+			}
+		}
+	}
+
+	printf("sha256 known answers %s\n", fails? "FAIL" : "ok");
+
+	return fails;
+}
+
+static double host_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (double)__builtin_ia32_rdtsc();
+#else
+	return host_now() * 1e9; /* nanoseconds where there is no TSC */
+#endif
+}
+
+/* Host cycles per byte hashing `len` bytes, tinycrypt's and the backend.
+ * Instruction time is not emulated, so on the target it is the sha sum of
+ * the boot trace over the image size that tells. */
+static void hash_bench(size_t len)
+{
+	struct tc_sha256_state_struct ref;
+	struct hash_state s;
+	uint8_t digest[HASH_DIGEST_SIZE];
+	double t, tc, fast;
+
+	t = host_cycles();
+	tc_sha256_init(&ref);
+	tc_sha256_update(&ref, image, len);
+	tc_sha256_final(digest, &ref);
+	tc = (host_cycles() - t) / (double)len;
+
+	t = host_cycles();
+	hash_init(&s);
+	hash_update(&s, image, len);
+	hash_final(&s, digest);
+	fast = (host_cycles() - t) / (double)len;
+
+	printf("  %-12s tinycrypt %.1f, backend %.1f host cycles/B\n",
+			"sha256", tc, fast);
+}
+
+static int unhex(uint8_t *out, const char *hex)
+{
+	int n = 0;
+
+	for (; hex[0] && hex[1]; hex += 2)
+		sscanf(hex, "%2hhx", &out[n++]);
+
+	return n;
+}
+
+/* The AES-CTR engine against the SP 800-38A F.5.1 known answer, then
+ * against tinycrypt's, which mkimg encrypts with, for every length up to a
+ * few blocks at odd alignments, in place and across the counter wrapping
+ * around. */
+static int aes_kat(void)
+{
+	struct tc_aes_key_sched_struct ref;
+	struct ctr_key ctx;
+	uint8_t k[16], ctr[16], ctr2[16], pt[64], ct[64], out[64];
+	uint8_t msg[100], a[100], b[104];
+	int fails = 0;
+
+	unhex(k, "2b7e151628aed2a6abf7158809cf4f3c");
+	unhex(ctr, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+	unhex(pt, "6bc1bee22e409f96e93d7e117393172a"
+			"ae2d8a571e03ac9c9eb76fac45af8e51"
+			"30c81c46a35ce411e5fbc1191a0a52ef"
+			"f69f2445df4f9b17ad2b417be66c3710");
+	unhex(ct, "874d6191b620e3261bef6864990db6ce"
+			"9806f66b7970fdff8617187bb9fffdff"
+			"5ae4df3edbd5d35e5b4f09020db03eab"
+			"1e031dda2fbe03d1792170a0f3009cee");
+	ctr_setkey(&ctx, k);
+	ctr_crypt(out, pt, sizeof(pt), ctr, &ctx);
+	if (memcmp(out, ct, sizeof(ct)) || ctr[15] != 0x03) {
+		printf("  aes-ctr SP 800-38A F.5.1: mismatch\n");
+		fails++;
+	}
+
+	for (size_t i = 0; i < sizeof(msg); i++)
+		msg[i] = (uint8_t)(i * 73 + 5);
+	tc_aes128_set_encrypt_key(&ref, k);
+
+	for (size_t len = 0; len <= sizeof(msg); len++) {
+		for (int off = 0; off < 4; off++) {
+			unhex(ctr, "000102030405060708090a0bfffffffe");
+			ctr[11] = (uint8_t)len;
+			memcpy(ctr2, ctr, sizeof(ctr));
+			if (len)
+				tc_ctr_mode(a, len, msg, len, ctr, &ref);
+
+			/* in place at an odd alignment */
+			memcpy(&b[off], msg, len);
+			ctr_crypt(&b[off], &b[off], len, ctr2, &ctx);
+			if (memcmp(a, &b[off], len) ||
+					memcmp(ctr, ctr2, sizeof(ctr))) {
+				printf("  aes-ctr %zu bytes at +%d: "
+						"mismatch\n", len, off);
+				fails++;
+			}
+		}
+	}
+
+	printf("aes-ctr known answers %s\n", fails? "FAIL" : "ok");
+
+	return fails;
+}
+
+/* The CRC against the check values of CRC-32/MPEG-2 and of the STM32 CRC
+ * unit, then against a bit at a time one for every length up to a few
+ * words at odd alignments. */
+static uint32_t crc_ref(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffffU;
+	size_t n = len & ~(size_t)3;
+
+	for (size_t i = 0; i < len; i++) {
+		/* the bytes of a word go in from the most significant */
+		crc ^= (uint32_t)p[i < n? (i & ~(size_t)3) + 3 - (i & 3) : i]
+			<< 24;
+		for (int j = 0; j < 8; j++)
+			crc = (crc << 1) ^ ((crc >> 31)? 0x04C11DB7U : 0);
+	}
+
+	return crc;
+}
+
+static int crc_kat(void)
+{
+	const uint8_t word[4] = { 0x78, 0x56, 0x34, 0x12 };
+	uint8_t msg[40], buf[44];
+	int fails = 0;
+
+	if (crc32("123456789", 9) != 0xbf99399cU ||
+			crc32(word, sizeof(word)) != 0xdf8a8a2bU ||
+			crc32("", 0) != 0xffffffffU) {
+		printf("  crc32 check values: mismatch\n");
+		fails++;
+	}
+
+	for (size_t i = 0; i < sizeof(msg); i++)
+		msg[i] = (uint8_t)(i * 73 + 5);
+
+	for (size_t len = 0; len <= sizeof(msg); len++) {
+		for (int off = 0; off < 4; off++) {
+			memcpy(&buf[off], msg, len);
+			if (crc32(&buf[off], len) != crc_ref(msg, len)) {
+				printf("  crc32 %zu bytes at +%d: mismatch\n",
+						len, off);
+				fails++;
+			}
+		}
+	}
+
+	printf("crc32 known answers %s\n", fails? "FAIL" : "ok");
+
+	return fails;
+}
+
+/* Ed25519 against the RFC 8032 7.1 test 1 and 2 known answers, signing
+ * and verifying, and a signature with a bit flipped. */
+static int ed25519_kat(void)
+{
+	static const char *const vectors[][4] = {
+		{ "9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60",
+		  "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a",
+		  "",
+		  "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e06522490155"
+		  "5fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b" },
+		{ "4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb",
+		  "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c",
+		  "72",
+		  "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da"
+		  "085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00" },
+	};
+	uint8_t seed[32], pub[32], msg[1], sig[64], out[64];
+	int fails = 0, n;
+
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		unhex(seed, vectors[i][0]);
+		unhex(pub, vectors[i][1]);
+		n = unhex(msg, vectors[i][2]);
+		unhex(sig, vectors[i][3]);
+
+		ed25519_pubkey(out, seed);
+		fails += !!memcmp(out, pub, sizeof(pub));
+		ed25519_sign(out, msg, (size_t)n, seed);
+		fails += !!memcmp(out, sig, sizeof(sig));
+		fails += !!ed25519_verify(sig, msg, (size_t)n, pub);
+		sig[i * 40] ^= 4;
+		fails += !ed25519_verify(sig, msg, (size_t)n, pub);
+	}
+
+	printf("ed25519 known answers %s\n", fails? "FAIL" : "ok");
+
+	return fails;
+}
+
+/* Host cycles of a signature check of a digest, secp256r1 through uECC
+ * and Ed25519. On the target the sig sum of the boot trace tells. */
+static int sig_bench(void)
+{
+	uint8_t digest[HASH_DIGEST_SIZE], priv[32], pub[64], sig[64];
+	double t, ecdsa, ed;
+	int err = 0;
+
+	memset(digest, 0x5a, sizeof(digest));
+
+	if (!uECC_make_key(pub, priv, uECC_secp256r1()) ||
+			!uECC_sign(priv, digest, sizeof(digest), sig,
+				uECC_secp256r1()))
+		return 1;
+	t = host_cycles();
+	err |= !uECC_verify(pub, digest, sizeof(digest), sig,
+			uECC_secp256r1());
+	ecdsa = host_cycles() - t;
+
+	memcpy(priv, key.aes, sizeof(key.aes)); /* any seed does */
+	ed25519_pubkey(pub, priv);
+	ed25519_sign(sig, digest, sizeof(digest), priv);
+	t = host_cycles();
+	err |= ed25519_verify(sig, digest, sizeof(digest), pub);
+	ed = host_cycles() - t;
+
+	printf("signature check secp256r1 %.0f, ed25519 %.0f host cycles %s\n",
+			ecdsa, ed, err? "FAIL" : "");
+
+	return err;
+}
+
+/* Host cycles per byte of AES-CTR over `len` bytes, tinycrypt's and the
+ * engine, the same way as hash_bench(). */
+static void aes_bench(size_t len)
+{
+	struct tc_aes_key_sched_struct ref;
+	struct ctr_key ctx;
+	uint8_t ctr[CTR_BLOCK_SIZE] = { 0, }, *out;
+	double t, tc, fast;
+
+	if ((out = malloc(len)) == NULL)
+		return;
+
+	t = host_cycles();
+	tc_aes128_set_encrypt_key(&ref, key.aes);
+	tc_ctr_mode(out, len, image, len, ctr, &ref);
+	tc = (host_cycles() - t) / (double)len;
+
+	t = host_cycles();
+	ctr_setkey(&ctx, key.aes);
+	ctr_crypt(out, image, len, ctr, &ctx);
+	fast = (host_cycles() - t) / (double)len;
+
+	printf("  %-12s tinycrypt %.1f, engine %.1f host cycles/B\n",
+			"aes-ctr", tc, fast);
+	free(out);
+}
+
+/* Host cycles per byte of the CRC pre-check. On the target the CRC unit
+ * takes a word in 4 AHB cycles, and the crc sum of the boot trace tells. */
+static void crc_bench(size_t len)
+{
+	double t;
+	volatile uint32_t crc;
+
+	t = host_cycles();
+	crc = crc32(image, len);
+	t = (host_cycles() - t) / (double)len;
+	(void)crc;
+
+	printf("  %-12s table %.1f host cycles/B\n", "crc32", t);
+}
+
+static void set_bootopt(uint32_t addr, const struct appimg_t *img)
+{
+	unsigned int buf[38];
+
+	buf[0] = addr;
+	buf[1] = img->len;
+	memcpy(&buf[2], img->hash, HASH_SIZE);
+	memcpy(&buf[18], img->iv, INITIAL_VECTOR_SIZE);
+	memcpy(&buf[22], img->plain, HASH_SIZE);
+
+	emu_fill((uintptr_t)&_bootopt, 0xff, (size_t)&_sector_size);
+	emu_load((uintptr_t)&_bootopt, buf, sizeof(buf));
+}
+
+/* Keys, a BootOpt pointing at the app and an app region holding a previous
+ * image, which is what an update finds on a deployed part. */
+static void provision(uintptr_t staging)
+{
+	uint32_t addr = (uint32_t)(uintptr_t)&_app;
+
+	emu_fill((uintptr_t)&_rom_start, 0xff, emu_flash_size());
+	emu_fill((uintptr_t)&_app, 0, staging - (uintptr_t)&_app);
+	emu_load((uintptr_t)&_aeskey, key.aes, sizeof(key.aes));
+	emu_load((uintptr_t)&_pubkey, key.pub, sizeof(key.pub));
+	emu_load((uintptr_t)&_bootopt, &addr, sizeof(addr));
+}
+
+/* `fix` makes it a small fix of the same app: a word of it changed, under
+ * a new IV, and past 1 the next release of it, 64 bytes inserted a third
+ * of the way in besides, pushing the rest along. With IMG_LZ4 in `flags`
+ * the app is made of words out of a few dozen, as code repeats itself, and
+ * gets compressed. With IMG_SPARSE a quarter of it from an odd offset and
+ * the last eighth are left erased, as are a few bytes too few to bother
+ * with, and it gets staged without them. */
+static const struct appimg_t *stage(uintptr_t staging, size_t len, int fix,
+		uint32_t flags)
+{
+	uint32_t *plain, seed = (uint32_t)len;
+	uint8_t iv[INITIAL_VECTOR_SIZE];
+	size_t n;
+
+	if ((plain = malloc(len + 4)) == NULL)
+		return NULL;
+
+	for (size_t i = 0; i < len / 4 + 1; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		plain[i] = seed;
+		if (flags & IMG_LZ4)
+			plain[i] = (seed & 0x3f) * 0x9e3779b1U;
+	}
+	plain[0] = 0x20000000 + 0x5000; /* stack pointer */
+	plain[1] = (uint32_t)linked + 0x201; /* reset, thumb */
+	memcpy(iv, &plain[2], sizeof(iv));
+	if (fix) {
+		plain[len / 8] ^= 1;
+		iv[0] ^= (uint8_t)fix;
+	}
+	if (fix > 1) {
+		memmove((uint8_t *)plain + len / 3 + 64,
+				(uint8_t *)plain + len / 3, len - len / 3 - 64);
+		memset((uint8_t *)plain + len / 3, 0x5a, 64);
+	}
+	if (flags & IMG_SPARSE) {
+		memset((uint8_t *)plain + len / 4 + 5, 0xff, len / 4);
+		memset((uint8_t *)plain + len / 8, 0xff, 9);
+		memset((uint8_t *)plain + len - len / 8, 0xff, len / 8);
+	}
+
+	n = mkimg(image, plain, len, iv, flags, &key);
+	free(plain);
+	if (!n)
+		return NULL;
+
+	emu_load(staging, image, n);
+
+	return (const struct appimg_t *)staging;
+}
+
+/* The next release as a delta against the image staged last, the one
+ * installed, in the staging slot. Returns its size. */
+static size_t stage_delta(uintptr_t staging, size_t len)
+{
+	uint8_t iv[INITIAL_VECTOR_SIZE] = { 0xde, 0x17, 0xa0 };
+	uint8_t *base, *delta;
+	size_t n = 0;
+
+	base = malloc(mkimg_size(len));
+	delta = malloc(mkdelta_size(len));
+	if (base != NULL && delta != NULL) {
+		memcpy(base, image, mkimg_size(len));
+		if (stage(staging, len, 2, 0) != NULL)
+			n = mkdelta(delta, base, image, iv, &key);
+	}
+	if (n) {
+		emu_fill(staging, 0xff, mkimg_size(len));
+		emu_load(staging, delta, n);
+	}
+	free(base);
+	free(delta);
+
+	return n;
+}
+
+/* Boots with a sender on the other end of a pty, which the bootloader
+ * finds on the line and downloads the image from into the staging slot, or
+ * the slot not booted with ABSLOT, as it would from a host on the UART. The
+ * sender's counts come back in `st` through a pipe. */
+static int download_pty(size_t len, struct sample *s, struct send_stats *st)
+{
+	struct pollfd pfd;
+	int master, slave, fds[2], status, err;
+	pid_t pid;
+
+	memset(st, 0, sizeof(*st));
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+			grantpt(master) || unlockpt(master) ||
+			(slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0 ||
+			send_setup_tty(slave, 115200) || pipe(fds)) {
+		perror("pty");
+		return 1;
+	}
+
+	fflush(NULL);
+	if ((pid = fork()) == 0) {
+		close(master);
+		close(fds[0]);
+		err = !!send_image(slave, image, mkimg_size(len), NULL, st);
+		_exit(err || write(fds[1], st, sizeof(*st)) != sizeof(*st));
+	}
+	close(slave);
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return 1;
+	}
+
+	/* the sender is on the line by the time the bootloader looks */
+	pfd.fd = master;
+	pfd.events = POLLIN;
+	poll(&pfd, 1, 5000);
+	emu_uart_attach(master);
+
+	sample_start(s);
+	err = emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+	sample_end(s);
+
+	emu_uart_attach(-1);
+	close(master);
+	waitpid(pid, &status, 0);
+	err |= read(fds[0], st, sizeof(*st)) != sizeof(*st);
+	close(fds[0]);
+
+	return err || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+#if defined(ABSLOT)
+/* Slot A booted, the next release downloaded into slot B, installed on the
+ * way with nothing of slot A erased, and booted, the banks swapped on F4.
+ * Then another into slot A going bad in flash before it is ever booted,
+ * which has slot B booted on. */
+static int ab_bench(size_t len)
+{
+	const struct bootopt_t *bootopt = (const struct bootopt_t *)&_bootopt;
+	uintptr_t a = (uintptr_t)&_app, b = (uintptr_t)&_slot_b;
+	struct send_stats st;
+	struct sample s;
+	uint32_t entry;
+	uint8_t c;
+	int err, fails = 0;
+
+	/* on F4 linked for slot A either way, which bank 2 shows at */
+#if !defined(stm32f4)
+	linked = b;
+#endif
+	entry = (uint32_t)linked + 0x201;
+	stage(b, len, 3, 0); /* what the slot held before, to be erased */
+	err = download_pty(len, &s, &st) || bootopt->addr != b ||
+		st.naks || st.resent || st.timeouts;
+	for (int i = 0; i < emu_nsectors(); i++)
+		err |= emu_sector_base(i) >= a &&
+			emu_sector_base(i) < (uintptr_t)&_staging &&
+			emu_stats()->erase[i] != 0;
+	report("ab download", len, &s, err);
+	report_send(&st);
+	report_erase();
+	fails += err;
+
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_RUN || emu_entry() != entry;
+	sample_end(&s);
+#if defined(stm32f4)
+	err |= !(SYSCFG_MEMRMP & SYSCFG_MEMRMP_FB_MODE);
+#endif
+	report("ab boot", len, &s, err);
+	report_trace();
+	fails += err;
+
+	linked = a;
+	stage(a, len, 4, 0);
+	err = download_pty(len, &s, &st) || bootopt->addr != a ||
+		st.naks || st.resent || st.timeouts;
+	c = *(const uint8_t *)(a + len / 2) ^ 0x10;
+	emu_load(a + len / 2, &c, 1);
+	sample_start(&s);
+	err |= emu_boot(yaboot_main) != EMU_HALT_REBOOT ||
+		bootopt->addr != b;
+	err |= emu_boot(yaboot_main) != EMU_HALT_RUN || emu_entry() != entry;
+	sample_end(&s);
+	report("ab fallback", len, &s, err);
+	fails += err;
+
+	return fails;
+}
+#endif
+
+static int bench(size_t len)
+{
+	static const struct {
+		uint32_t flags;
+		const char *name;
+	} packed[] = {
+		{ IMG_LZ4, "lz" },
+		{ IMG_SPARSE, "sparse" },
+	};
+	uintptr_t app = (uintptr_t)&_app;
+	uintptr_t staging = (uintptr_t)&_rom_start + emu_flash_size() / 2;
+	const struct appimg_t *img;
+	const struct deltaimg_t *delta;
+	struct sample s;
+	unsigned long units, lo, hi;
+	size_t n;
+#if !defined(ABSLOT)
+	struct send_stats st;
+	uint32_t crc;
+	uint8_t b;
+#endif
+	char op[16];
+	int err, fails = 0;
+
+	if (app + mkimg_size(len) >= staging ||
+			staging + mkimg_size(len) > (uintptr_t)&_scratch) {
+		fprintf(stderr, "%zu bytes does not fit\n", len);
+		return 1;
+	}
+
+	provision(staging);
+	if ((img = stage(staging, len, 0, 0)) == NULL) {
+		fprintf(stderr, "failed to build image\n");
+		return 1;
+	}
+
+	/* as main() does before any of the below */
+	clock_init();
+	uart_init();
+	flash_set_idle(uart_poll);
+
+	printf("image %zu bytes, app 0x%08lx, staging 0x%08lx, %lu Hz\n",
+			len, (unsigned long)app, (unsigned long)staging,
+			emu_cpu_hz());
+	printf("  %-12s %12s %12s %10s %10s\n", "op", "host B/s",
+			"emu B/s", "emu ms", "busy ms");
+
+	sample_start(&s);
+	err = verify_staged(img, &_pubkey);
+	sample_end(&s);
+	report("verify", len, &s, err);
+	fails += !!err;
+
+	sample_start(&s);
+	err = install((void *)app, img, &_pubkey, &_aeskey);
+	sample_end(&s);
+	report("install", len, &s, err);
+	fails += !!err;
+	report_erase();
+
+	hash_bench(len);
+	aes_bench(len);
+	crc_bench(len);
+
+	sample_start(&s);
+	err = verify(img->plain, (const uint8_t *)app, img->len, &_pubkey);
+	sample_end(&s);
+	report("verify app", len, &s, err);
+	fails += !!err;
+
+	provision(staging);
+	stage(staging, len, 0, 0);
+	set_bootopt((uint32_t)staging, img);
+
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+	sample_end(&s);
+	report("update", len, &s, err);
+	report_trace();
+	report_erase();
+	fails += err;
+	units = emu_stats()->program_units;
+
+	/* the same update with the power cut halfway through programming */
+	provision(staging);
+	stage(staging, len, 0, 0);
+	set_bootopt((uint32_t)staging, img);
+	emu_powerfail(units / 2);
+	err = emu_boot(yaboot_main) != EMU_HALT_POWERLOSS;
+	emu_powerfail(0);
+
+	sample_start(&s);
+	err |= emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+	sample_end(&s);
+	report("resume", len, &s, err);
+	fails += err;
+
+	sample_start(&s);
+	/* with the clocks back as out of reset */
+	err = emu_boot(yaboot_main) != EMU_HALT_RUN ||
+		emu_entry() != ((const uint32_t *)app)[1] ||
+		emu_cpu_hz() != reset_hz;
+	sample_end(&s);
+	report("boot", len, &s, err);
+	report_trace();
+	fails += err;
+
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_RUN;
+	sample_end(&s);
+	report("boot cached", len, &s, err);
+	fails += err;
+
+	/* the same image again, then a small fix of it: only what differs
+	 * and the sector taking the header get erased */
+	set_bootopt((uint32_t)staging, img);
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+	sample_end(&s);
+	report("update same", len, &s, err);
+	report_erase();
+	fails += err;
+
+	stage(staging, len, 1, 0);
+	set_bootopt((uint32_t)staging, img);
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+	sample_end(&s);
+	report("update fix", len, &s, err);
+	report_trace();
+	report_erase();
+	fails += err;
+
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_RUN;
+	sample_end(&s);
+	report("boot fix", len, &s, err);
+	fails += err;
+
+	/* the next release as a delta: rebuilt past it in the staging slot
+	 * and installed in the same boot, the app being checked against the
+	 * release on the boot after */
+	n = stage_delta(staging, len);
+	delta = (const struct deltaimg_t *)staging;
+	set_bootopt((uint32_t)staging, (const struct appimg_t *)delta);
+	sample_start(&s);
+	err = !n || emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+	sample_end(&s);
+	report("delta", len, &s, err);
+	printf("  %-12s patch %lu bytes\n", "", (unsigned long)delta->len);
+	report_trace();
+	report_erase();
+	fails += err;
+
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_RUN;
+	sample_end(&s);
+	report("boot delta", len, &s, err);
+	fails += err;
+
+	/* the same delta again, not for the app any more: turned away with
+	 * nothing of the app erased, which boots as it is */
+	set_bootopt((uint32_t)staging, (const struct appimg_t *)delta);
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_RUN;
+	sample_end(&s);
+	err |= delta->magic[0] == MAGIC1;
+	for (int i = 0; i < emu_nsectors(); i++)
+		err |= emu_sector_base(i) >= app &&
+			emu_sector_base(i) < staging &&
+			emu_stats()->erase[i] != 0;
+	report("delta stale", len, &s, err);
+	fails += err;
+
+#if defined(ABSLOT)
+	fails += ab_bench(len);
+#else
+	/* what was in the staging slot before, to be erased */
+	emu_fill(staging, 0, mkimg_size(len));
+	err = download_pty(len, &s, &st) ||
+		st.naks || st.resent || st.timeouts;
+	report("download", len, &s, err);
+	report_send(&st);
+	report_erase();
+	fails += err;
+	err = memcmp((const void *)staging, image, mkimg_size(len)) ||
+		((const struct bootopt_t *)&_bootopt)->addr != staging;
+	fails += err;
+
+	/* the staged image going bad in flash after it was checked: turned
+	 * away on the CRC before any of the app is erased */
+	b = image[offsetof(struct appimg_t, data) + len / 2] ^ 0x10;
+	emu_load(staging + offsetof(struct appimg_t, data) + len / 2, &b, 1);
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_FREEZE;
+	sample_end(&s);
+	err |= emu_stats()->mass_erase != 0 || img->magic[0] == MAGIC1;
+	for (int i = 0; i < emu_nsectors(); i++)
+		err |= emu_stats()->erase[i] != 0;
+	report("corrupt", len, &s, err);
+	report_trace();
+	fails += err;
+
+	/* one with its CRC made to match but not its signature: turned away
+	 * before any of the app is erased, which boots on */
+	stage(staging, len, 0, 0);
+	set_bootopt((uint32_t)staging, img);
+	emu_load(staging + offsetof(struct appimg_t, data) + len / 2, &b, 1);
+	crc = crc32(img->data, img->size);
+	emu_load(staging + offsetof(struct appimg_t, crc), &crc, sizeof(crc));
+	sample_start(&s);
+	err = emu_boot(yaboot_main) != EMU_HALT_RUN ||
+		emu_entry() != ((const uint32_t *)app)[1] ||
+		img->magic[0] == MAGIC1 ||
+		((const struct bootopt_t *)&_bootopt)->addr != app;
+	sample_end(&s);
+	err |= emu_stats()->mass_erase != 0;
+	for (int i = 0; i < emu_nsectors(); i++)
+		err |= emu_stats()->erase[i] != 0 &&
+			emu_sector_base(i) >= app &&
+			emu_sector_base(i) < staging;
+	report("forged", len, &s, err);
+	fails += err;
+#endif
+
+	/* programming alone, over the app erased beforehand */
+	err = flash_erase_range((void *)app, len);
+	sample_start(&s);
+	err |= flash_program((void *)app, image, len) != len;
+	sample_end(&s);
+	err |= memcmp((const void *)app, image, len) != 0;
+	report("program", len, &s, err);
+	fails += err;
+
+	/* small writes into the app that has to be kept around them, each
+	 * sector saved in a scratch sector while it is erased */
+	sample_start(&s);
+	for (n = 0, err = 0; n < RMW_WRITES; n++) {
+		uint8_t patch[RMW_SIZE];
+		size_t off = (len / RMW_WRITES * n + 124) & ~3UL;
+
+		memset(patch, 0xa5 ^ (int)n, sizeof(patch));
+		memcpy(&image[off], patch, sizeof(patch));
+		err |= flash_update((void *)(app + off), patch,
+				sizeof(patch)) != sizeof(patch);
+	}
+	sample_end(&s);
+	err |= memcmp((const void *)app, image, len) != 0;
+	/* the scratch sectors taking turns, none erased more than once over
+	 * another, or none at all for sectors merged in RAM */
+	lo = ~0UL;
+	hi = 0;
+	for (int i = 0; i < emu_nsectors(); i++) {
+		if (emu_sector_base(i) < (uintptr_t)&_scratch)
+			continue;
+		lo = emu_stats()->erase[i] < lo? emu_stats()->erase[i] : lo;
+		hi = emu_stats()->erase[i] > hi? emu_stats()->erase[i] : hi;
+	}
+	err |= hi - lo > 1;
+	report("rmw", RMW_WRITES * RMW_SIZE, &s, err);
+	printf("  %-12s %d writes of %d bytes, %.1f ms each\n", "",
+			RMW_WRITES, RMW_SIZE,
+			(double)s.emu_ns / 1e6 / RMW_WRITES);
+	printf("  %-12s scratch sectors erased x%lu-%lu each\n", "", lo, hi);
+	report_erase();
+	fails += err;
+
+	/* compressed, then sparse, a smaller image staged and unpacked on
+	 * the way to the app, then the same update cut off halfway, which
+	 * starts over but programs only what was not done */
+	for (size_t k = 0; k < sizeof(packed) / sizeof(packed[0]); k++) {
+		provision(staging);
+		img = stage(staging, len, 0, packed[k].flags);
+		set_bootopt((uint32_t)staging, img);
+		sample_start(&s);
+		err = emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+		sample_end(&s);
+		snprintf(op, sizeof(op), "update %s", packed[k].name);
+		report(op, len, &s, err);
+		printf("  %-12s staged %lu bytes\n", "",
+				(unsigned long)img->size);
+		report_trace();
+		report_erase();
+		fails += err;
+		units = emu_stats()->program_units;
+
+		provision(staging);
+		stage(staging, len, 0, packed[k].flags);
+		set_bootopt((uint32_t)staging, img);
+		emu_powerfail(units / 2);
+		err = emu_boot(yaboot_main) != EMU_HALT_POWERLOSS;
+		emu_powerfail(0);
+
+		sample_start(&s);
+		err |= emu_boot(yaboot_main) != EMU_HALT_REBOOT;
+		sample_end(&s);
+		snprintf(op, sizeof(op), "resume %s", packed[k].name);
+		report(op, len, &s, err);
+		report_erase();
+		fails += err;
+
+		sample_start(&s);
+		err = emu_boot(yaboot_main) != EMU_HALT_RUN;
+		sample_end(&s);
+		snprintf(op, sizeof(op), "boot %s", packed[k].name);
+		report(op, len, &s, err);
+		fails += err;
+	}
+
+	return fails;
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoul(s, &end, 0);
+
+	if (*end == 'k' || *end == 'K')
+		n <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		n <<= 20;
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *defaults[] = { "4K", "32K", "128K", NULL };
+	const char **sizes = defaults;
+	unsigned long cpu_hz = DEFAULT_CPU_HZ;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "c:v")) != -1) {
+		switch (opt) {
+		case 'c':
+			cpu_hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			emu_uart_log(stderr);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c cpu_hz] [-v] "
+					"[size[K|M]...]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind < argc)
+		sizes = (const char **)&argv[optind];
+
+	reset_hz = cpu_hz;
+	linked = (uintptr_t)&_app;
+	if (emu_init(cpu_hz)) {
+		perror("emu_init");
+		return 1;
+	}
+	emu_irq_attach(USART1_IRQ, ISR_usart1);
+	emu_irq_attach(FLASH_IRQ, ISR_flash);
+	if (mkimg_keygen(&key)) {
+		fprintf(stderr, "failed to generate keys\n");
+		return 1;
+	}
+	if ((image = malloc(emu_flash_size())) == NULL)
+		return 1;
+
+	printf("%s, %lu Hz, %zu KB flash\n",
+#if defined(stm32f4)
+			"stm32f4",
+#else
+			"stm32f1",
+#endif
+			cpu_hz, emu_flash_size() >> 10);
+
+	fails += hash_kat();
+	fails += aes_kat();
+	fails += crc_kat();
+	fails += ed25519_kat();
+	fails += sig_bench();
+	for (; *sizes; sizes++)
+		fails += bench(parse_size(*sizes));
+
+	return !!fails;
+}
@@ -0,0 +1,922 @@
+#include "bsp.h"
+#include "bsp/flash/flash.h"
+#include "uart.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE		0 /* checked against the hint below */
+#endif
+
+#define EMU_UART_BAUD			115200UL /* until USART1_BRR is set */
+#define EMU_UART_RXMARK			(1U << 31) /* DR as last presented */
+#define EMU_UART_WAIT_MS		20 /* for the host side when idle */
+#define EMU_UART_IDLE_MAX		1000000 /* polls with nothing to come */
+#define EMU_REG_CYCLES			4 /* ldr + tst + branch of a poll loop */
+#define EMU_HSE_HZ			8000000UL
+#define EMU_T_HSE_NS			2000000ULL /* tSU(HSE) */
+
+#if defined(stm32f1) || defined(stm32f3)
+#define EMU_FLASH_SIZE			(FLASH_ADDR_END + 1 - EMU_FLASH_ORIGIN)
+#define EMU_ERR_PROG			(1U << BIT_FLASH_PROG_ERR)
+
+/* STM32F103xE datasheet, typical values */
+#define T_PROG_NS			52500ULL /* 16-bit word */
+#define T_ERASE_NS			20000000ULL /* page */
+#define T_MASS_ERASE_NS			20000000ULL
+
+#define T_PLL_NS			200000ULL /* tLOCK, max */
+#define WS_HZ				24000000UL /* a wait state per */
+#define ACR_LATENCY			0x7U
+#define ACR_RESET			0x30U /* prefetch on */
+#define CFGR_PPRE2			11
+#elif defined(stm32f4)
+#define EMU_FLASH_SIZE			(2UL << 20)
+#define EMU_ERR_PROG			(1U << BIT_FLASH_PROG_SEQ_ERR)
+
+/* STM32F42x datasheet, typical values indexed by PSIZE (x8, x16, x32 and
+ * x64 with VPP) */
+#define T_PROG_NS			16000ULL
+static const unsigned long long t_erase_16k[4] = {
+	400000000ULL, 300000000ULL, 250000000ULL, 230000000ULL };
+static const unsigned long long t_erase_64k[4] = {
+	1200000000ULL, 700000000ULL, 550000000ULL, 490000000ULL };
+static const unsigned long long t_erase_128k[4] = {
+	2000000000ULL, 1300000000ULL, 1000000000ULL, 875000000ULL };
+static const unsigned long long t_mass_erase[4] = {
+	16000000000ULL, 11000000000ULL, 8000000000ULL, 6900000000ULL };
+
+#define T_PLL_NS			100000ULL /* tLOCK, max */
+#define WS_HZ				30000000UL /* a wait state per, 2.7-3.6V */
+#define ACR_LATENCY			0xfU
+#define ACR_RESET			0U
+#define CFGR_PPRE2			13
+#define PLLCFGR_RESET			0x24003010U
+#else
+#error undefined machine
+#endif
+
+const unsigned char emu_uid[] = {
+	0x30, 0x00, 0x41, 0x00, 0x0f, 0x51, 0x33, 0x34,
+	0x38, 0x37, 0x31, 0x31,
+};
+
+static struct {
+	volatile unsigned int regs[EMU_NREGS];
+	unsigned int sr, cr; /* as latched by the emulator */
+	int key;
+	int locked;
+	int op; /* erase in progress */
+	unsigned long long busy_until;
+	unsigned long long reg_ns;
+	unsigned long cpu_hz; /* HCLK */
+	unsigned long hsi_hz;
+	unsigned long pclk2_hz;
+	unsigned int sws; /* system clock switch status */
+	unsigned long long hse_at, pll_at; /* when ready */
+	int last_reg; /* accessed before the current one */
+
+	int rww; /* busy on the bank the CPU is not running from */
+	unsigned int nvic[3]; /* enabled */
+	int irq_on; /* PRIMASK clear */
+	int in_irq;
+	void (*isr[96])(void);
+
+	int uart_fd; /* the other end of USART1, -1 if none */
+	unsigned int uart_sr;
+	uint8_t uart_rdr; /* received, what reading DR gives */
+	unsigned long long tx_until; /* shifting out */
+	unsigned long long rx_at; /* when the next byte is in */
+	int tx_reply; /* sent something the host side may answer */
+	uint8_t rxq[256]; /* read from uart_fd, not on the line yet */
+	size_t rxq_head, rxq_tail;
+	unsigned long uart_idle;
+
+	uint8_t *flash; /* mapped at EMU_FLASH_ORIGIN */
+	uint8_t *shadow; /* contents as committed by the controller */
+	size_t pagesize;
+	size_t npages;
+	unsigned char *dirty;
+	size_t *dirtylist;
+	size_t ndirty;
+
+	jmp_buf *jmp;
+	uintptr_t entry;
+	unsigned long powerfail; /* program_units to cut the power at */
+	FILE *uart;
+
+	struct emu_stats stats;
+} emu;
+
+static void on_fault(int sig, siginfo_t *si, void *uctx)
+{
+	uintptr_t addr = (uintptr_t)si->si_addr;
+	size_t page;
+
+	(void)uctx;
+
+	if (addr < EMU_FLASH_ORIGIN || addr >= EMU_FLASH_ORIGIN + EMU_FLASH_SIZE)
+		goto fatal;
+
+	page = (addr - EMU_FLASH_ORIGIN) / emu.pagesize;
+	if (emu.dirty[page]) /* already writable, so not a store */
+		goto fatal;
+
+	mprotect(emu.flash + page * emu.pagesize, emu.pagesize,
+			PROT_READ | PROT_WRITE);
+	emu.dirty[page] = 1;
+	emu.dirtylist[emu.ndirty++] = page;
+	return;
+
+fatal:
+	signal(sig, SIG_DFL);
+}
+
+#if !defined(stm32f4)
+static int is_filled(const uint8_t *p, int c, size_t n)
+{
+	while (n--)
+		if (*p++ != (uint8_t)c)
+			return 0;
+	return 1;
+}
+#endif
+
+static unsigned int program_unit_size(void)
+{
+#if defined(stm32f4)
+	return 1U << ((emu.cr >> BIT_FLASH_PROGRAM_SIZE) & 3);
+#else
+	return 2;
+#endif
+}
+
+static void set_busy(unsigned long long ns)
+{
+	unsigned long long start;
+
+	start = emu.busy_until > emu.stats.now_ns?
+		emu.busy_until : emu.stats.now_ns;
+	emu.busy_until = start + ns;
+	emu.stats.busy_ns += ns;
+	emu.sr |= 1U << BIT_FLASH_BUSY;
+	emu.rww = 0;
+}
+
+/* The core doing nothing until `until`, CYCCNT counting on */
+static void stall(unsigned long long until)
+{
+	unsigned long long ns;
+
+	if (until <= emu.stats.now_ns)
+		return;
+
+	ns = until - emu.stats.now_ns;
+	if ((emu.regs[EMU_DEMCR] & (1U << 24)) && (emu.regs[EMU_DWT_CTRL] & 1))
+		emu.regs[EMU_DWT_CYCCNT] += (unsigned int)(ns * emu.cpu_hz
+				/ 1000000000ULL);
+	emu.stats.now_ns = until;
+}
+
+static void program_unit(uint8_t *mem, uint8_t *old, unsigned int n)
+{
+	if (emu.locked || !(emu.cr & (1U << BIT_FLASH_PROGRAM)))
+		goto err;
+#if defined(stm32f4)
+	for (unsigned int i = 0; i < n; i++)
+		mem[i] &= old[i]; /* bits can only go from 1 to 0 */
+#else
+	if (!is_filled(old, 0xff, n) && !is_filled(mem, 0, n))
+		goto err;
+#endif
+	memcpy(old, mem, n);
+	emu.stats.program_units++;
+	emu.stats.program_bytes += n;
+	set_busy(T_PROG_NS);
+	return;
+err:
+	memcpy(mem, old, n);
+	emu.sr |= EMU_ERR_PROG;
+	emu.stats.errors++;
+}
+
+static void commit(void)
+{
+	unsigned int unit = program_unit_size();
+	unsigned long units = emu.stats.program_units;
+	size_t off;
+	uint8_t *mem, *old;
+
+	for (size_t i = 0; i < emu.ndirty; i++) {
+		off = emu.dirtylist[i] * emu.pagesize;
+		mem = emu.flash + off;
+		old = emu.shadow + off;
+
+		for (size_t j = 0; j < emu.pagesize; j += unit) {
+			if (!memcmp(&mem[j], &old[j], unit))
+				continue;
+			program_unit(&mem[j], &old[j], unit);
+		}
+
+		mprotect(mem, emu.pagesize, PROT_READ);
+		emu.dirty[emu.dirtylist[i]] = 0;
+	}
+
+	emu.ndirty = 0;
+
+	/* a write while the flash is busy holds the bus, and the core with
+	 * it, until the one before is done, so the last one of those written
+	 * back to back got through only once the flash started on it */
+	if (emu.stats.program_units != units)
+		stall(emu.busy_until - T_PROG_NS);
+}
+
+static void erase(uintptr_t addr, size_t len)
+{
+	uint8_t *p = (uint8_t *)addr;
+
+	mprotect(p, len, PROT_READ | PROT_WRITE);
+	memset(p, 0xff, len);
+	memset(emu.shadow + (addr - EMU_FLASH_ORIGIN), 0xff, len);
+	mprotect(p, len, PROT_READ);
+}
+
+#if defined(stm32f4)
+static void start_erase(void)
+{
+	unsigned int psize = (emu.cr >> BIT_FLASH_PROGRAM_SIZE) & 3;
+	unsigned int snb;
+	int sector;
+	size_t size;
+
+	if (emu.cr & ((1U << BIT_FLASH_MASS_ERASE) |
+				(1U << BIT_FLASH_MASS_ERASE2))) {
+		if (emu.cr & (1U << BIT_FLASH_MASS_ERASE))
+			erase(emu_sector_base(0), EMU_FLASH_SIZE / 2);
+		if (emu.cr & (1U << BIT_FLASH_MASS_ERASE2))
+			erase(emu_sector_base(12), EMU_FLASH_SIZE / 2);
+		emu.stats.mass_erase++;
+		set_busy(t_mass_erase[psize]);
+		return;
+	}
+
+	if (!(emu.cr & (1U << BIT_FLASH_SECTOR_ERASE)))
+		return;
+
+	snb = (emu.cr >> BIT_FLASH_SECTOR_NR) & 0x1f;
+	sector = (snb & 0x10)? 12 + (int)(snb & 0xf) : (int)snb;
+	if (sector >= NSECTORS) {
+		emu.sr |= EMU_ERR_PROG;
+		emu.stats.errors++;
+		return;
+	}
+
+	size = emu_sector_size(sector);
+	erase(emu_sector_base(sector), size);
+	emu.stats.erase[sector]++;
+
+	if (size == 16 << 10)
+		set_busy(t_erase_16k[psize]);
+	else if (size == 64 << 10)
+		set_busy(t_erase_64k[psize]);
+	else
+		set_busy(t_erase_128k[psize]);
+	emu.rww = sector >= 12; /* the bootloader is in bank 1 */
+}
+#else
+static void start_erase(void)
+{
+	uintptr_t addr;
+	int sector;
+
+	if (emu.cr & (1U << BIT_FLASH_MASS_ERASE)) {
+		erase(EMU_FLASH_ORIGIN, EMU_FLASH_SIZE);
+		emu.stats.mass_erase++;
+		set_busy(T_MASS_ERASE_NS);
+		return;
+	}
+
+	if (!(emu.cr & (1U << BIT_FLASH_SECTOR_ERASE)))
+		return;
+
+	addr = emu.regs[EMU_FLASH_AR];
+	if (addr < EMU_FLASH_ORIGIN ||
+			addr >= EMU_FLASH_ORIGIN + EMU_FLASH_SIZE) {
+		emu.sr |= EMU_ERR_PROG;
+		emu.stats.errors++;
+		return;
+	}
+
+	sector = (int)((addr - EMU_FLASH_ORIGIN) / emu_sector_size(0));
+	erase(emu_sector_base(sector), emu_sector_size(sector));
+	emu.stats.erase[sector]++;
+	set_busy(T_ERASE_NS);
+}
+#endif
+
+static unsigned long long uart_byte_ns(void)
+{
+	unsigned int brr = emu.regs[EMU_USART1_BRR] & 0xffff;
+
+	if (!brr) /* 10 bits a frame, 8N1 */
+		return 10 * 1000000000ULL / EMU_UART_BAUD;
+
+	return 10ULL * brr * 1000000000ULL / emu.pclk2_hz;
+}
+
+static void uart_fill(int wait)
+{
+	ssize_t n;
+
+	if (emu.rxq_head == emu.rxq_tail)
+		emu.rxq_head = emu.rxq_tail = 0;
+	if (emu.rxq_tail == sizeof(emu.rxq))
+		return;
+
+	if (wait) {
+		struct pollfd pfd = { .fd = emu.uart_fd, .events = POLLIN };
+		poll(&pfd, 1, EMU_UART_WAIT_MS);
+	}
+
+	n = read(emu.uart_fd, &emu.rxq[emu.rxq_tail],
+			sizeof(emu.rxq) - emu.rxq_tail);
+	if (n <= 0)
+		return;
+
+	if (emu.rxq_head == emu.rxq_tail &&
+			emu.rx_at < emu.stats.now_ns + uart_byte_ns())
+		emu.rx_at = emu.stats.now_ns + uart_byte_ns();
+	emu.rxq_tail += (size_t)n;
+}
+
+static void uart_out(uint8_t c)
+{
+	if (emu.uart)
+		fputc(c, emu.uart);
+	if (emu.uart_fd >= 0 && write(emu.uart_fd, &c, 1) != 1)
+		fputs("emu: uart overflow\n", stderr);
+
+	emu.tx_until = emu.stats.now_ns + uart_byte_ns();
+	emu.tx_reply = 1;
+}
+
+/* USART1 at the register level: DR latched as written or read by the access
+ * before, TXE held for a frame time after a write, and RXNE raised as bytes
+ * from the host side come in on the line at the baud rate, with ORE when
+ * one is missed. The host side is treated as infinitely fast: when the
+ * firmware is done sending, or has nothing else to do but wait for it,
+ * virtual time stands still until it answers. */
+static void uart_tick(int reg)
+{
+	unsigned int cr1 = emu.regs[EMU_USART1_CR1];
+	unsigned int v = emu.regs[EMU_USART1_DR];
+	int enabled = !!(cr1 & (1U << USART_UE));
+	unsigned long long next;
+	uint8_t c;
+
+	if (emu.last_reg == EMU_USART1_DR) {
+		if (!(v & EMU_UART_RXMARK)) { /* written */
+			c = (uint8_t)v;
+			if (enabled && (cr1 & (1U << USART_TE)))
+				uart_out(c);
+		} else { /* read */
+			emu.uart_sr &= ~((1U << USART_RXNE) | (1U << USART_ORE));
+		}
+	}
+
+	if (emu.stats.now_ns >= emu.tx_until)
+		emu.uart_sr |= (1U << USART_TXE) | (1U << USART_TC);
+	else
+		emu.uart_sr &= ~((1U << USART_TXE) | (1U << USART_TC));
+
+	if (reg == EMU_USART1_SR && emu.stats.now_ns >= emu.tx_until &&
+			!(cr1 & (1U << USART_TXEIE)) &&
+			!(emu.uart_sr & (1U << USART_RXNE)) &&
+			(emu.sr & (1U << BIT_FLASH_BUSY)) && emu.uart_fd >= 0) {
+		/* polled as the flash is waited for: on at once to the next
+		 * byte in, or a byte time while the host side sends nothing,
+		 * or an erase would take the sender longer than its timeout
+		 * to get through */
+		if (emu.rxq_head == emu.rxq_tail)
+			uart_fill(0);
+		next = emu.rxq_head != emu.rxq_tail? emu.rx_at :
+			emu.stats.now_ns + uart_byte_ns();
+		stall(next < emu.busy_until? next : emu.busy_until);
+	} else if (reg == EMU_USART1_SR &&
+			emu.stats.now_ns >= emu.tx_until &&
+			!(cr1 & (1U << USART_TXEIE)) &&
+			!(emu.uart_sr & (1U << USART_RXNE)) &&
+			!(emu.sr & (1U << BIT_FLASH_BUSY)) &&
+			emu.rxq_head == emu.rxq_tail) {
+		/* nothing but the host side to wait for */
+		if (emu.uart_fd < 0) {
+			if (++emu.uart_idle > EMU_UART_IDLE_MAX) {
+				emu.uart_idle = 0;
+				emu_halt(EMU_HALT_FREEZE, 0);
+			}
+		} else {
+			uart_fill(1);
+		}
+	} else if (reg == EMU_USART1_DR) {
+		emu.uart_idle = 0;
+	}
+
+	if (emu.uart_fd >= 0 && !(enabled && (cr1 & (1U << USART_RE)))) {
+		/* nobody listening on the line */
+		do {
+			emu.rxq_head = emu.rxq_tail = 0;
+			uart_fill(0);
+		} while (emu.rxq_tail);
+		emu.rxq_head = emu.rxq_tail = 0;
+	} else if (emu.uart_fd >= 0 && emu.rxq_head == emu.rxq_tail) {
+		uart_fill(emu.tx_reply && emu.stats.now_ns >= emu.tx_until &&
+				!(cr1 & (1U << USART_TXEIE)));
+		if (emu.stats.now_ns >= emu.tx_until)
+			emu.tx_reply = 0;
+	}
+
+	/* all of them come in at once after the core was stalled */
+	while (emu.rxq_head != emu.rxq_tail && emu.stats.now_ns >= emu.rx_at) {
+		c = emu.rxq[emu.rxq_head++];
+		emu.rx_at += uart_byte_ns();
+		if (enabled && (cr1 & (1U << USART_RE))) {
+			if (emu.uart_sr & (1U << USART_RXNE)) {
+				emu.uart_sr |= 1U << USART_ORE; /* lost */
+			} else {
+				emu.uart_sr |= 1U << USART_RXNE;
+				emu.uart_rdr = c;
+			}
+		}
+	}
+
+	emu.regs[EMU_USART1_DR] = emu.uart_rdr | EMU_UART_RXMARK;
+	emu.regs[EMU_USART1_SR] = emu.uart_sr;
+	emu.last_reg = reg;
+}
+
+static int pll_src_hse(unsigned int cfgr)
+{
+#if defined(stm32f4)
+	(void)cfgr;
+	return !!(emu.regs[EMU_RCC_PLLCFGR] & (1U << 22));
+#else
+	return !!(cfgr & (1U << 16));
+#endif
+}
+
+static unsigned long pll_hz(unsigned int cfgr)
+{
+	unsigned long src = pll_src_hse(cfgr)? EMU_HSE_HZ : emu.hsi_hz;
+#if defined(stm32f4)
+	unsigned int pllcfgr = emu.regs[EMU_RCC_PLLCFGR];
+	unsigned int m = pllcfgr & 0x3f;
+	unsigned int n = (pllcfgr >> 6) & 0x1ff;
+	unsigned int p = (((pllcfgr >> 16) & 3) + 1) * 2;
+
+	return m? src / m * n / p : 0;
+#else
+	unsigned int mul = ((cfgr >> 18) & 0xf) + 2;
+
+	if (!pll_src_hse(cfgr))
+		src /= 2;
+	else if (cfgr & (1U << 17))
+		src /= 2; /* PLLXTPRE */
+
+	return src * (mul > 16? 16 : mul);
+#endif
+}
+
+/* HSE and PLL get ready some time after being turned on, and the system
+ * clock switches over to whichever is selected once it is. HCLK and PCLK2
+ * follow the prescalers, and the flash gets read wrong with fewer wait
+ * states than HCLK takes. */
+static void rcc_tick(void)
+{
+	static const unsigned int hpre_shift[8] = { 1, 2, 3, 4, 6, 7, 8, 9 };
+	unsigned int cr = emu.regs[EMU_RCC_CR];
+	unsigned int cfgr = emu.regs[EMU_RCC_CFGR];
+	unsigned long long now = emu.stats.now_ns;
+	unsigned int hpre, ppre2;
+	unsigned long hclk;
+	int hse, pll;
+
+	if (!(cr & (1U << 16)))
+		emu.hse_at = 0;
+	else if (!emu.hse_at)
+		emu.hse_at = now + EMU_T_HSE_NS;
+	hse = emu.hse_at && now >= emu.hse_at;
+
+	if (!(cr & (1U << 24)))
+		emu.pll_at = 0;
+	else if (!emu.pll_at)
+		emu.pll_at = now + T_PLL_NS;
+	pll = emu.pll_at && now >= emu.pll_at && (hse || !pll_src_hse(cfgr));
+
+	cr &= ~((1U << 17) | (1U << 25));
+	emu.regs[EMU_RCC_CR] = cr | ((unsigned int)hse << 17) |
+		((unsigned int)pll << 25);
+
+	if ((cfgr & 3) == 0 || ((cfgr & 3) == 1 && hse) ||
+			((cfgr & 3) == 2 && pll))
+		emu.sws = cfgr & 3;
+	emu.regs[EMU_RCC_CFGR] = (cfgr & ~(3U << 2)) | (emu.sws << 2);
+
+	hclk = emu.sws == 0? emu.hsi_hz :
+		emu.sws == 1? EMU_HSE_HZ : pll_hz(cfgr);
+	hpre = (cfgr >> 4) & 0xf;
+	if (hpre & 8)
+		hclk >>= hpre_shift[hpre & 7];
+	ppre2 = (cfgr >> CFGR_PPRE2) & 7;
+	emu.pclk2_hz = hclk >> ((ppre2 & 4)? (ppre2 & 3) + 1 : 0);
+
+	if (hclk != emu.cpu_hz) {
+		emu.cpu_hz = hclk;
+		emu.reg_ns = EMU_REG_CYCLES * 1000000000ULL / hclk;
+	}
+
+	if ((emu.regs[EMU_FLASH_ACR] & ACR_LATENCY) < (hclk - 1) / WS_HZ)
+		emu_halt(EMU_HALT_FAULT, 0);
+}
+
+static int irq_enabled(int irq)
+{
+	return emu.isr[irq] && (emu.nvic[irq / 32] & (1U << (irq % 32)));
+}
+
+/* The one to take, or -1 */
+static int irq_pending(void)
+{
+	unsigned int cr1 = emu.regs[EMU_USART1_CR1];
+
+	if (!emu.irq_on || emu.in_irq)
+		return -1;
+
+	if (irq_enabled(FLASH_IRQ) &&
+			(((emu.cr & (1U << BIT_FLASH_END_OP_INT)) &&
+			  (emu.sr & (1U << BIT_FLASH_EOP))) ||
+			 ((emu.cr & (1U << BIT_FLASH_ERR_INT)) &&
+			  (emu.sr & FLASH_STATUS_ERROR_MASK))))
+		return FLASH_IRQ;
+
+	if (!irq_enabled(USART1_IRQ) || !(cr1 & (1U << USART_UE)))
+		return -1;
+
+	return (((cr1 & (1U << USART_RXNEIE)) && (emu.uart_sr &
+			((1U << USART_RXNE) | (1U << USART_ORE)))) ||
+		((cr1 & (1U << USART_TXEIE)) &&
+		 (emu.uart_sr & (1U << USART_TXE))))? USART1_IRQ : -1;
+}
+
+/* `reg` is the access the interrupt came in before, if any. The vector
+ * fetch from a bank being programmed or erased waits for it to be done. */
+static void take_irq(int reg)
+{
+	int irq;
+
+	while ((irq = irq_pending()) >= 0) {
+		if ((emu.sr & (1U << BIT_FLASH_BUSY)) && !emu.rww)
+			stall(emu.busy_until);
+		emu.in_irq = 1;
+		emu.isr[irq]();
+		emu.in_irq = 0;
+		uart_tick(-1); /* DR as the ISR left it */
+		emu.last_reg = reg;
+	}
+}
+
+static void tick(int reg)
+{
+	unsigned int v;
+
+	emu.stats.now_ns += emu.reg_ns;
+	if ((emu.regs[EMU_DEMCR] & (1U << 24)) && (emu.regs[EMU_DWT_CTRL] & 1))
+		emu.regs[EMU_DWT_CYCCNT] += EMU_REG_CYCLES;
+
+	rcc_tick();
+	uart_tick(reg);
+
+	/* set and clear-enable registers read back as enabled */
+	for (int i = 0; i < 3; i++) {
+		emu.nvic[i] |= emu.regs[EMU_NVIC_ISER0 + i];
+		emu.nvic[i] &= ~emu.regs[EMU_NVIC_ICER0 + i];
+		emu.regs[EMU_NVIC_ISER0 + i] = emu.nvic[i];
+		emu.regs[EMU_NVIC_ICER0 + i] = 0;
+		emu.regs[EMU_NVIC_ICPR0 + i] = 0;
+	}
+
+	/* status flags are cleared by writing 1 */
+	v = emu.regs[EMU_FLASH_SR];
+	if (v != emu.sr)
+		emu.sr &= ~(v & FLASH_STATUS_MASK);
+
+	v = emu.regs[EMU_FLASH_KEYR];
+	if (v) {
+		if (v == FLASH_UNLOCK_KEY1)
+			emu.key = 1;
+		else if (v == FLASH_UNLOCK_KEY2 && emu.key == 1)
+			emu.locked = emu.key = 0;
+		else
+			emu.key = 0;
+		emu.regs[EMU_FLASH_KEYR] = 0;
+	}
+
+	v = emu.regs[EMU_FLASH_CR];
+	if (v != emu.cr) {
+		if (emu.locked)
+			v = emu.cr;
+		else if (v & (1U << BIT_FLASH_LOCK))
+			emu.locked = 1;
+		emu.cr = v;
+	}
+	if (emu.locked)
+		emu.cr |= 1U << BIT_FLASH_LOCK;
+	else
+		emu.cr &= ~(1U << BIT_FLASH_LOCK);
+
+	commit();
+
+	if (emu.powerfail && emu.stats.program_units >= emu.powerfail) {
+		emu.powerfail = 0;
+		emu_halt(EMU_HALT_POWERLOSS, 0);
+	}
+
+	if ((emu.cr & (1U << BIT_FLASH_START)) && !emu.op) {
+		emu.op = 1;
+		if (emu.locked) {
+			emu.sr |= EMU_ERR_PROG;
+			emu.stats.errors++;
+		} else {
+			start_erase();
+		}
+	}
+
+	if ((emu.sr & (1U << BIT_FLASH_BUSY)) &&
+			emu.stats.now_ns >= emu.busy_until) {
+		emu.sr &= ~(1U << BIT_FLASH_BUSY);
+#if defined(stm32f4)
+		if (emu.cr & (1U << BIT_FLASH_END_OP_INT))
+#endif
+			emu.sr |= 1U << BIT_FLASH_EOP;
+	}
+	if (emu.op && !(emu.sr & (1U << BIT_FLASH_BUSY))) {
+		emu.cr &= ~(1U << BIT_FLASH_START);
+		emu.op = 0;
+	}
+
+	emu.regs[EMU_FLASH_SR] = emu.sr;
+	emu.regs[EMU_FLASH_CR] = emu.cr;
+
+	take_irq(reg);
+}
+
+volatile unsigned int *emu_reg(int reg)
+{
+	tick(reg);
+	return &emu.regs[reg];
+}
+
+static void reset_core(void)
+{
+	commit();
+	if (emu.busy_until > emu.stats.now_ns)
+		emu.stats.now_ns = emu.busy_until;
+
+	memset((void *)emu.regs, 0, sizeof(emu.regs));
+	emu.sr = 0;
+	emu.cr = 1U << BIT_FLASH_LOCK;
+	emu.locked = 1;
+	emu.key = emu.op = emu.rww = 0;
+	emu.regs[EMU_FLASH_CR] = emu.cr;
+	emu.regs[EMU_FLASH_OPT_RDP] = 0x5aa5;
+	emu.regs[EMU_FLASH_ACR] = ACR_RESET;
+
+	emu.regs[EMU_RCC_CR] = 0x83; /* HSI on and ready */
+#if defined(stm32f4)
+	emu.regs[EMU_RCC_PLLCFGR] = PLLCFGR_RESET;
+#endif
+	emu.sws = 0;
+	emu.hse_at = emu.pll_at = 0;
+	emu.cpu_hz = emu.pclk2_hz = emu.hsi_hz;
+	emu.reg_ns = EMU_REG_CYCLES * 1000000000ULL / emu.hsi_hz;
+
+	emu.uart_sr = (1U << USART_TXE) | (1U << USART_TC);
+	emu.regs[EMU_USART1_SR] = emu.uart_sr;
+	emu.regs[EMU_USART1_DR] = EMU_UART_RXMARK;
+	emu.last_reg = -1;
+	emu.uart_idle = 0;
+
+	memset(emu.nvic, 0, sizeof(emu.nvic));
+	emu.irq_on = emu.in_irq = 0; /* cli() first thing in ISR_reset */
+}
+
+int emu_init(unsigned long cpu_hz)
+{
+	struct sigaction sa;
+	void *p;
+
+	emu.pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	emu.npages = EMU_FLASH_SIZE / emu.pagesize;
+	emu.hsi_hz = cpu_hz;
+	emu.uart_fd = -1;
+
+	p = mmap((void *)EMU_FLASH_ORIGIN, EMU_FLASH_SIZE,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (p != (void *)EMU_FLASH_ORIGIN)
+		return -1;
+
+	emu.flash = p;
+	emu.shadow = malloc(EMU_FLASH_SIZE);
+	emu.dirty = calloc(emu.npages, 1);
+	emu.dirtylist = calloc(emu.npages, sizeof(*emu.dirtylist));
+	if (!emu.shadow || !emu.dirty || !emu.dirtylist)
+		return -1;
+
+	memset(emu.flash, 0xff, EMU_FLASH_SIZE);
+	memset(emu.shadow, 0xff, EMU_FLASH_SIZE);
+	mprotect(emu.flash, EMU_FLASH_SIZE, PROT_READ);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = on_fault;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, NULL))
+		return -1;
+
+	reset_core();
+
+	return 0;
+}
+
+unsigned long emu_cpu_hz(void)
+{
+	return emu.cpu_hz;
+}
+
+void emu_uart_log(FILE *fp)
+{
+	emu.uart = fp;
+}
+
+void emu_uart_attach(int fd)
+{
+	if (fd >= 0)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	emu.uart_fd = fd;
+	emu.rxq_head = emu.rxq_tail = 0;
+}
+
+void emu_irq_attach(int irq, void (*isr)(void))
+{
+	emu.isr[irq] = isr;
+}
+
+void emu_irq_enable(int on)
+{
+	emu.irq_on = on;
+	take_irq(-1);
+}
+
+unsigned int emu_irq_save(void)
+{
+	unsigned int primask = !emu.irq_on;
+
+	emu.irq_on = 0;
+
+	return primask;
+}
+
+void emu_load(uintptr_t addr, const void *buf, size_t len)
+{
+	uintptr_t base = BASE_ALIGN(addr, emu.pagesize);
+	size_t span = addr + len - base;
+
+	commit();
+	mprotect((void *)base, span, PROT_READ | PROT_WRITE);
+	memcpy((void *)addr, buf, len);
+	memcpy(emu.shadow + (addr - EMU_FLASH_ORIGIN), buf, len);
+	mprotect((void *)base, span, PROT_READ);
+}
+
+void emu_fill(uintptr_t addr, int c, size_t len)
+{
+	uintptr_t base = BASE_ALIGN(addr, emu.pagesize);
+	size_t span = addr + len - base;
+
+	commit();
+	mprotect((void *)base, span, PROT_READ | PROT_WRITE);
+	memset((void *)addr, c, len);
+	memset(emu.shadow + (addr - EMU_FLASH_ORIGIN), c, len);
+	mprotect((void *)base, span, PROT_READ);
+}
+
+size_t emu_flash_size(void)
+{
+	return EMU_FLASH_SIZE;
+}
+
+size_t emu_sector_size(int sector)
+{
+	return (size_t)get_sector_size_kb(sector) << 10;
+}
+
+int emu_nsectors(void)
+{
+#if defined(stm32f4)
+	return NSECTORS;
+#else
+	return (int)(EMU_FLASH_SIZE / emu_sector_size(0));
+#endif
+}
+
+uintptr_t emu_sector_base(int sector)
+{
+	uintptr_t addr = EMU_FLASH_ORIGIN;
+
+	for (int i = 0; i < sector; i++)
+		addr += emu_sector_size(i);
+
+	return addr;
+}
+
+const struct emu_stats *emu_stats(void)
+{
+	return &emu.stats;
+}
+
+void emu_stats_reset(void)
+{
+	unsigned long long now = emu.stats.now_ns;
+
+	memset(&emu.stats, 0, sizeof(emu.stats));
+	emu.stats.now_ns = now;
+}
+
+int emu_boot(void (*fn)(void))
+{
+	jmp_buf jb;
+	int reason;
+
+	reset_core();
+
+	emu.jmp = &jb;
+	if ((reason = setjmp(jb)) == 0) {
+		fn();
+		reason = EMU_HALT_RUN;
+	}
+	emu.jmp = NULL;
+
+	return reason;
+}
+
+void emu_powerfail(unsigned long units)
+{
+	emu.powerfail = units? emu.stats.program_units + units : 0;
+}
+
+void emu_halt(int reason, uintptr_t entry)
+{
+	emu.entry = entry;
+
+	if (!emu.jmp)
+		exit(reason);
+
+	longjmp(*emu.jmp, reason);
+}
+
+uintptr_t emu_entry(void)
+{
+	return emu.entry;
+}
+
+char *itoa(int value, char *str, int base)
+{
+	char tmp[33], *p = tmp, *s = str;
+	unsigned int v;
+
+	if (base == 10 && value < 0) {
+		*s++ = '-';
+		v = -(unsigned int)value;
+	} else {
+		v = (unsigned int)value;
+	}
+
+	do {
+		*p++ = "0123456789abcdefghijklmnopqrstuvwxyz"[v % base];
+		v /= base;
+	} while (v);
+
+	while (p > tmp)
+		*s++ = *--p;
+	*s = '\0';
+
+	return str;
+}
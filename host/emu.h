@@ -0,0 +1,185 @@
+#ifndef __EMU_H__
+#define __EMU_H__
+
+/* Host-side stand-in for the MCU. Peripheral registers resolve to slots in
+ * the emulator, and the flash array is mapped at its real address so the
+ * bootloader code runs unmodified. Every register access gives the emulator
+ * a chance to latch what software wrote since the previous access, which is
+ * how FLASH_KEYR/FLASH_CR sequences, write-1-to-clear status bits and
+ * programming of the flash array are modeled. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+enum emu_regs {
+	EMU_SCB_VTOR,
+	EMU_SCB_AIRCR,
+	EMU_SCB_CCR,
+	EMU_NVIC_ISER0,
+	EMU_NVIC_ISER1,
+	EMU_NVIC_ISER2,
+	EMU_NVIC_ICER0,
+	EMU_NVIC_ICER1,
+	EMU_NVIC_ICER2,
+	EMU_NVIC_ICPR0,
+	EMU_NVIC_ICPR1,
+	EMU_NVIC_ICPR2,
+	EMU_DEMCR,
+	EMU_DWT_CTRL,
+	EMU_DWT_CYCCNT,
+	EMU_FLASH_ACR,
+	EMU_FLASH_KEYR,
+	EMU_FLASH_OPTKEYR,
+	EMU_FLASH_SR,
+	EMU_FLASH_CR,
+	EMU_FLASH_AR,
+	EMU_FLASH_OBR,
+	EMU_FLASH_WRPR,
+	EMU_FLASH_OPTCR,
+	EMU_FLASH_OPT_RDP,
+	EMU_RCC_CR,
+	EMU_RCC_CFGR,
+	EMU_RCC_PLLCFGR,
+	EMU_RCC_AHBENR,
+	EMU_RCC_APB2ENR,
+	EMU_SYSCFG_MEMRMP,
+	EMU_GPIOA_CRH,
+	EMU_GPIOA_MODER,
+	EMU_GPIOA_AFRH,
+	EMU_USART1_SR,
+	EMU_USART1_DR,
+	EMU_USART1_BRR,
+	EMU_USART1_CR1,
+	EMU_NREGS,
+};
+
+volatile unsigned int *emu_reg(int reg);
+
+#define SCB_VTOR		(*emu_reg(EMU_SCB_VTOR))
+#define SCB_AIRCR		(*emu_reg(EMU_SCB_AIRCR))
+#define SCB_CCR 		(*emu_reg(EMU_SCB_CCR))
+
+#define NVIC_ISER(n)		(*emu_reg(EMU_NVIC_ISER0 + (n)))
+#define NVIC_ICER(n)		(*emu_reg(EMU_NVIC_ICER0 + (n)))
+/* Nothing is latched pending, an interrupt being taken while its source
+ * asks for it */
+#define NVIC_ICPR(n)		(*emu_reg(EMU_NVIC_ICPR0 + (n)))
+
+/* CYCCNT counts the cycles of virtual time, which is register accesses and
+ * what they wait for, not instructions */
+#define DEMCR			(*emu_reg(EMU_DEMCR))
+#define DWT_CTRL		(*emu_reg(EMU_DWT_CTRL))
+#define DWT_CYCCNT		(*emu_reg(EMU_DWT_CYCCNT))
+
+#define FLASH_ACR		(*emu_reg(EMU_FLASH_ACR))
+#define FLASH_KEYR		(*emu_reg(EMU_FLASH_KEYR))
+#define FLASH_OPTKEYR		(*emu_reg(EMU_FLASH_OPTKEYR))
+#define FLASH_SR		(*emu_reg(EMU_FLASH_SR))
+#define FLASH_CR		(*emu_reg(EMU_FLASH_CR))
+#define FLASH_AR		(*emu_reg(EMU_FLASH_AR))
+#define FLASH_OBR		(*emu_reg(EMU_FLASH_OBR))
+#define FLASH_WRPR		(*emu_reg(EMU_FLASH_WRPR))
+#define FLASH_OPTCR		(*emu_reg(EMU_FLASH_OPTCR))
+#define FLASH_OPT_RDP		(*(volatile unsigned short int *)emu_reg(EMU_FLASH_OPT_RDP))
+
+extern const unsigned char emu_uid[];
+#define UID_BASE		((uintptr_t)emu_uid)
+
+#define RCC_CR			(*emu_reg(EMU_RCC_CR))
+#define RCC_CFGR		(*emu_reg(EMU_RCC_CFGR))
+#define RCC_PLLCFGR		(*emu_reg(EMU_RCC_PLLCFGR))
+#define RCC_AHBENR		(*emu_reg(EMU_RCC_AHBENR))
+#define RCC_APB2ENR		(*emu_reg(EMU_RCC_APB2ENR))
+#if defined(stm32f4)
+#define RCC_AHBENR_GPIOAEN	(1U << 0)
+#define RCC_APB2ENR_USART1EN	(1U << 4)
+#else
+#define RCC_APB2ENR_IOPAEN	(1U << 2)
+#define RCC_APB2ENR_USART1EN	(1U << 14)
+#endif
+#define RCC_APB2ENR_SYSCFGEN	(1U << 14)
+/* FB_MODE is only kept, the bootloader jumping right after setting it */
+#define SYSCFG_MEMRMP		(*emu_reg(EMU_SYSCFG_MEMRMP))
+#define SYSCFG_MEMRMP_FB_MODE	(1U << 8)
+#define GPIOA_CRH		(*emu_reg(EMU_GPIOA_CRH))
+#define GPIOA_MODER		(*emu_reg(EMU_GPIOA_MODER))
+#define GPIOA_AFRH		(*emu_reg(EMU_GPIOA_AFRH))
+
+#define USART1_SR		(*emu_reg(EMU_USART1_SR))
+#define USART1_DR		(*emu_reg(EMU_USART1_DR))
+#define USART1_BRR		(*emu_reg(EMU_USART1_BRR))
+#define USART1_CR1		(*emu_reg(EMU_USART1_CR1))
+
+/* PRIMASK */
+#define sei()			emu_irq_enable(1)
+#define cli()			emu_irq_enable(0)
+#define irq_save()		emu_irq_save()
+#define irq_restore(primask)	emu_irq_enable(!(primask))
+#define dmb()			__asm__ __volatile__("" ::: "memory")
+#define dsb()			__asm__ __volatile__("" ::: "memory")
+#define isb()			__asm__ __volatile__("" ::: "memory")
+
+#define EMU_FLASH_ORIGIN	0x08000000UL
+#define EMU_NSECTORS_MAX	512
+
+enum emu_halt {
+	EMU_HALT_RUN		= 1, /* jumped to the application */
+	EMU_HALT_REBOOT,
+	EMU_HALT_FREEZE,
+	EMU_HALT_POWERLOSS,
+	EMU_HALT_FAULT, /* too few flash wait states for the clock */
+};
+
+struct emu_stats {
+	unsigned long long now_ns; /* virtual time */
+	unsigned long long busy_ns; /* time FLASH_SR BSY was held */
+	unsigned long erase[EMU_NSECTORS_MAX];
+	unsigned long mass_erase;
+	unsigned long program_units;
+	unsigned long program_bytes;
+	unsigned long errors;
+};
+
+/* `cpu_hz` is the HSI, what the core runs on out of reset. The RCC switches
+ * it to the HSE at 8MHz or the PLL, register access and USART1 timing
+ * following. */
+int emu_init(unsigned long cpu_hz);
+unsigned long emu_cpu_hz(void);
+/* What goes out of USART1 is copied to `fp`. With `fd` attached, USART1
+ * sends to and receives from it, e.g. the master side of a pty. */
+void emu_uart_log(FILE *fp);
+void emu_uart_attach(int fd);
+
+/* What reset.c puts in the vector table. Interrupts get taken on register
+ * accesses. One taken while FLASH_SR BSY is set for the bank the CPU runs
+ * from stalls the whole core until the flash is done, as the vector is
+ * fetched from it, with nothing else running meanwhile. */
+void emu_irq_attach(int irq, void (*isr)(void));
+void emu_irq_enable(int on);
+/* PRIMASK as it was, 1 if set, then set */
+unsigned int emu_irq_save(void);
+
+/* Flash contents as written by an external programmer: no latency, no
+ * accounting, and erased state is not required. */
+void emu_load(uintptr_t addr, const void *buf, size_t len);
+void emu_fill(uintptr_t addr, int c, size_t len);
+
+size_t emu_flash_size(void);
+int emu_nsectors(void);
+uintptr_t emu_sector_base(int sector);
+size_t emu_sector_size(int sector);
+
+const struct emu_stats *emu_stats(void);
+void emu_stats_reset(void);
+
+/* Runs `fn` until it halts: jumps to the app, reboots or freezes. */
+int emu_boot(void (*fn)(void));
+void emu_halt(int reason, uintptr_t entry) __attribute__((noreturn));
+uintptr_t emu_entry(void);
+/* Cuts the power once `units` more program units got committed. */
+void emu_powerfail(unsigned long units);
+
+char *itoa(int value, char *str, int base);
+
+#endif /* __EMU_H__ */
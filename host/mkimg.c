@@ -0,0 +1,460 @@
+#include "mkimg.h"
+#include "image.h"
+#include "tinycrypt/sha256.h"
+#include "tinycrypt/ecc_dh.h"
+#include "tinycrypt/ecc_dsa.h"
+#include "tinycrypt/ctr_mode.h"
+#include "tinycrypt/aes.h"
+#include "ed25519.h"
+#include "crc.h"
+#include "delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#define min(a, b)		((a) < (b)? (a) : (b))
+
+static int rng(uint8_t *dest, unsigned int size)
+{
+	FILE *fp;
+	size_t n;
+
+	if ((fp = fopen("/dev/urandom", "rb")) == NULL)
+		return 0;
+	n = fread(dest, 1, size, fp);
+	fclose(fp);
+
+	return n == size;
+}
+
+/* The public key is checked here, once, for the bootloader not to have to
+ * on every boot. */
+int mkimg_keygen(struct mkimg_key *key)
+{
+	uECC_set_rng(rng);
+	memset(key, 0, sizeof(*key));
+
+	if (!rng(key->aes, sizeof(key->aes)))
+		return -1;
+#if defined(ED25519)
+	if (!rng(key->priv, sizeof(key->priv)))
+		return -1;
+	ed25519_pubkey(key->pub, key->priv);
+#else
+	if (!uECC_make_key(key->pub, key->priv, uECC_secp256r1()) ||
+			uECC_valid_public_key(key->pub, uECC_secp256r1()))
+		return -1;
+#endif
+
+	return 0;
+}
+
+static int sign(uint8_t *sig, const uint8_t *digest,
+		const struct mkimg_key *key)
+{
+#if defined(ED25519)
+	ed25519_sign(sig, digest, TC_SHA256_DIGEST_SIZE, key->priv);
+	return 0;
+#else
+	return !uECC_sign(key->priv, digest, TC_SHA256_DIGEST_SIZE, sig,
+			uECC_secp256r1());
+#endif
+}
+
+size_t mkimg_size(size_t len)
+{
+	return sizeof(struct appimg_t) + len;
+}
+
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_DIST		65535
+#define LZ_HASH_BITS		16
+
+static uint8_t *lz_len(uint8_t *p, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*p++ = 255;
+	*p++ = (uint8_t)n;
+
+	return p;
+}
+
+static uint8_t *lz_seq(uint8_t *p, const uint8_t *lit, size_t nlit,
+		size_t dist, size_t match)
+{
+	uint8_t *token = p++;
+
+	*token = (uint8_t)(min(nlit, 15) << 4);
+	if (nlit >= 15)
+		p = lz_len(p, nlit - 15);
+	memcpy(p, lit, nlit);
+	p += nlit;
+
+	if (!match) /* the last one */
+		return p;
+
+	*p++ = (uint8_t)dist;
+	*p++ = (uint8_t)(dist >> 8);
+	match -= LZ_MIN_MATCH;
+	*token |= (uint8_t)min(match, 15);
+	if (match >= 15)
+		p = lz_len(p, match - 15);
+
+	return p;
+}
+
+/* Greedy LZ4, a block of it as lz.h has it. Returns its size, or 0 when it
+ * would not come out smaller than `len` into `out`. */
+static size_t lz4(uint8_t *out, const uint8_t *in, size_t len)
+{
+	static int32_t head[1 << LZ_HASH_BITS];
+	size_t t, lit, n, max = len + len / 255 + 16;
+	uint8_t *p, *buf;
+	uint32_t h, w;
+	int32_t c;
+
+	if ((buf = malloc(max)) == NULL)
+		return 0;
+	memset(head, 0xff, sizeof(head));
+
+	for (p = buf, t = lit = 0; t + LZ_MIN_MATCH <= len; ) {
+		memcpy(&w, &in[t], sizeof(w));
+		h = (w * 0x9e3779b1U) >> (32 - LZ_HASH_BITS);
+		c = head[h];
+		head[h] = (int32_t)t;
+		if (c < 0 || t - (size_t)c > LZ_MAX_DIST ||
+				memcmp(&in[c], &in[t], LZ_MIN_MATCH)) {
+			t++;
+			continue;
+		}
+
+		for (n = LZ_MIN_MATCH; t + n < len && in[c + n] == in[t + n];
+				n++)
+			;
+		p = lz_seq(p, &in[lit], t - lit, t - (size_t)c, n);
+		t += n;
+		lit = t;
+	}
+	p = lz_seq(p, &in[lit], len - lit, 0, 0);
+
+	n = (size_t)(p - buf);
+	if (n < len)
+		memcpy(out, buf, n);
+	free(buf);
+
+	return n < len? n : 0;
+}
+
+#define SPARSE_MIN_HOLE		64 /* erased bytes worth leaving out */
+
+/* The segment table followed by Data of the segments back to back, as
+ * image.h has it for IMG_SPARSE, into `out`, `*size` bytes in all. Returns
+ * the size of the table, or 0 when there is no hole to leave out. */
+static size_t sparse(uint8_t *out, const uint8_t *in, size_t len,
+		size_t *size)
+{
+	uint32_t *seg, n = 0;
+	size_t t, h, k = 0, table;
+	uint8_t *p;
+
+	seg = malloc(sizeof(*seg) * 2 * (len / SPARSE_MIN_HOLE + 2));
+	if (seg == NULL)
+		return 0;
+
+	for (t = 0; t < len; t = h < len? k : len) {
+		for (h = t; h < len; h = k) {
+			for (k = h; k < len && in[k] == 0xff; k++)
+				;
+			if (k - h >= SPARSE_MIN_HOLE)
+				break;
+			if (k == h)
+				k++;
+		}
+		if (h > t) {
+			seg[n * 2] = (uint32_t)t;
+			seg[n * 2 + 1] = (uint32_t)(h - t);
+			n++;
+		}
+	}
+
+	table = sizeof(n) + n * 2 * sizeof(*seg);
+	if (n == 1 && seg[1] == len) {
+		free(seg);
+		return 0;
+	}
+
+	memcpy(out, &n, sizeof(n));
+	memcpy(&out[sizeof(n)], seg, table - sizeof(n));
+	for (p = &out[table], k = 0; k < n; k++) {
+		memcpy(p, &in[seg[k * 2]], seg[k * 2 + 1]);
+		p += seg[k * 2 + 1];
+	}
+	*size = (size_t)(p - out);
+	free(seg);
+
+	return table;
+}
+
+size_t mkimg(void *out, const void *data, size_t len, const uint8_t *iv,
+		uint32_t flags, const struct mkimg_key *key)
+{
+	const uint32_t magic[3] = { MAGIC1, MAGIC2, MAGIC3 };
+	const uint32_t len32 = (uint32_t)len;
+	struct tc_aes_key_sched_struct aes;
+	struct tc_sha256_state_struct sha256;
+	uint8_t ctr[INITIAL_VECTOR_SIZE], digest[TC_SHA256_DIGEST_SIZE];
+	uint8_t *p = out, *e = &p[offsetof(struct appimg_t, data)];
+	uint32_t crc, size = len32;
+	size_t t = 0, n;
+
+	memcpy(&p[offsetof(struct appimg_t, magic)], magic, sizeof(magic));
+	memcpy(&p[offsetof(struct appimg_t, len)], &len32, sizeof(len32));
+	memcpy(&p[offsetof(struct appimg_t, iv)], iv, INITIAL_VECTOR_SIZE);
+
+	uECC_set_rng(rng);
+
+	tc_sha256_init(&sha256);
+	tc_sha256_update(&sha256, data, len);
+	tc_sha256_final(digest, &sha256);
+	if (sign(&p[offsetof(struct appimg_t, plain)], digest, key))
+		return 0;
+	crc = crc32(data, len);
+	memcpy(&p[offsetof(struct appimg_t, plain_crc)], &crc, sizeof(crc));
+
+	/* compressed or sparse only when it comes out smaller */
+	if ((flags & IMG_LZ4) && (flags & IMG_SPARSE))
+		return 0;
+	if (flags & IMG_LZ4) {
+		if ((size = (uint32_t)lz4(e, data, len)))
+			data = e;
+		else
+			flags &= ~IMG_LZ4;
+	}
+	if (flags & IMG_SPARSE) {
+		if ((t = sparse(e, data, len, &n))) {
+			size = (uint32_t)n;
+			data = &e[t];
+		} else {
+			flags &= ~IMG_SPARSE;
+		}
+	}
+	if (!(flags & (IMG_LZ4 | IMG_SPARSE)))
+		size = len32;
+	memcpy(&p[offsetof(struct appimg_t, flags)], &flags, sizeof(flags));
+	memcpy(&p[offsetof(struct appimg_t, size)], &size, sizeof(size));
+
+	memcpy(ctr, iv, sizeof(ctr));
+	tc_aes128_set_encrypt_key(&aes, key->aes);
+	if (size > t && !tc_ctr_mode(&e[t], size - t, data, size - t, ctr,
+				&aes))
+		return 0;
+
+	tc_sha256_init(&sha256);
+	tc_sha256_update(&sha256, e, size);
+	tc_sha256_update(&sha256, &p[offsetof(struct appimg_t, len)],
+			sizeof(len32));
+	tc_sha256_update(&sha256, &p[offsetof(struct appimg_t, flags)],
+			sizeof(flags));
+	tc_sha256_final(digest, &sha256);
+
+	if (sign(&p[offsetof(struct appimg_t, hash)], digest, key))
+		return 0;
+	crc = crc32(e, size);
+	memcpy(&p[offsetof(struct appimg_t, crc)], &crc, sizeof(crc));
+
+	return mkimg_size(size);
+}
+
+#define DIFF_MIN_MATCH		8 /* bytes indexed, a copy from anywhere */
+#define DIFF_MIN_CONT		4 /* a copy going on from the previous one */
+#define DIFF_HASH_BITS		16
+#define DIFF_CHAIN		32 /* candidates tried at a position */
+
+static uint32_t diff_hash(const uint8_t *p)
+{
+	uint32_t a, b;
+
+	memcpy(&a, p, sizeof(a));
+	memcpy(&b, &p[4], sizeof(b));
+
+	return ((a * 0x9e3779b1U) ^ (b * 0x85ebca77U)) >> (32 - DIFF_HASH_BITS);
+}
+
+static size_t diff_match(const uint8_t *a, const uint8_t *b, size_t max)
+{
+	size_t n;
+
+	for (n = 0; n < max && a[n] == b[n]; n++)
+		;
+
+	return n;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = (uint8_t)(v | 0x80);
+	*p++ = (uint8_t)v;
+
+	return p;
+}
+
+static uint8_t *put_insert(uint8_t *p, const uint8_t *data, size_t len)
+{
+	if (!len)
+		return p;
+
+	p = put_varint(p, (uint32_t)len << 1 | DELTA_INSERT);
+	memcpy(p, data, len);
+
+	return p + len;
+}
+
+/* Greedy, taking at each position of `new` the longest match among the ones
+ * the index of `old` has for its next DIFF_MIN_MATCH bytes and where the
+ * previous copy would go on after what was inserted since, a few bytes
+ * changed often being all there is between two copies. */
+static size_t diff(uint8_t *out, const uint8_t *old, size_t olen,
+		const uint8_t *new, size_t nlen)
+{
+	int32_t *head, *next, j;
+	size_t t, lit, last, cont, best, src, n, k;
+	uint8_t *p = out;
+	int32_t d;
+
+	head = malloc(sizeof(*head) << DIFF_HASH_BITS);
+	next = malloc(sizeof(*next) * (olen + 1));
+	if (head == NULL || next == NULL) {
+		free(head);
+		free(next);
+		return 0;
+	}
+	memset(head, 0xff, sizeof(*head) << DIFF_HASH_BITS);
+	for (t = 0; t + DIFF_MIN_MATCH <= olen; t++) {
+		next[t] = head[diff_hash(&old[t])];
+		head[diff_hash(&old[t])] = (int32_t)t;
+	}
+
+	for (t = lit = last = 0; t < nlen; ) {
+		best = src = 0;
+		cont = last + (t - lit);
+		if (cont < olen) {
+			best = diff_match(&old[cont], &new[t],
+					min(olen - cont, nlen - t));
+			src = cont;
+			if (best < DIFF_MIN_CONT)
+				best = 0;
+		}
+		j = t + DIFF_MIN_MATCH <= nlen? head[diff_hash(&new[t])] : -1;
+		for (k = 0; j >= 0 && k < DIFF_CHAIN; j = next[j], k++) {
+			n = diff_match(&old[j], &new[t],
+					min(olen - (size_t)j, nlen - t));
+			if (n >= DIFF_MIN_MATCH && n > best) {
+				best = n;
+				src = (size_t)j;
+			}
+		}
+		if (!best) {
+			t++;
+			continue;
+		}
+
+		p = put_insert(p, &new[lit], t - lit);
+		p = put_varint(p, (uint32_t)best << 1 | DELTA_COPY);
+		d = (int32_t)(src - last);
+		p = put_varint(p, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+		last = src + best;
+		t += best;
+		lit = t;
+	}
+	p = put_insert(p, &new[lit], nlen - lit);
+
+	free(head);
+	free(next);
+
+	return (size_t)(p - out);
+}
+
+size_t mkdelta_size(size_t len)
+{
+	return sizeof(struct deltaimg_t) + len + len / 4 + 16;
+}
+
+/* Data of an image as mkimg() made it, decrypted, uncompressed ones only */
+static uint8_t *plain_of(const uint8_t *img, size_t *len,
+		const struct mkimg_key *key)
+{
+	struct tc_aes_key_sched_struct aes;
+	uint8_t ctr[INITIAL_VECTOR_SIZE];
+	uint32_t len32, flags;
+	uint8_t *data;
+
+	memcpy(&len32, &img[offsetof(struct appimg_t, len)], sizeof(len32));
+	memcpy(&flags, &img[offsetof(struct appimg_t, flags)], sizeof(flags));
+	if (flags || (data = malloc(len32 + 1)) == NULL)
+		return NULL;
+
+	memcpy(ctr, &img[offsetof(struct appimg_t, iv)], sizeof(ctr));
+	tc_aes128_set_encrypt_key(&aes, key->aes);
+	if (len32 && !tc_ctr_mode(data, len32,
+				&img[offsetof(struct appimg_t, data)], len32,
+				ctr, &aes)) {
+		free(data);
+		return NULL;
+	}
+	*len = len32;
+
+	return data;
+}
+
+size_t mkdelta(void *out, const void *base, const void *target,
+		const uint8_t *iv, const struct mkimg_key *key)
+{
+	const uint32_t magic[3] = { MAGIC1, MAGIC2, MAGIC3_DELTA };
+	struct tc_aes_key_sched_struct aes;
+	struct tc_sha256_state_struct sha256;
+	uint8_t ctr[INITIAL_VECTOR_SIZE], digest[TC_SHA256_DIGEST_SIZE];
+	uint8_t *p = out, *old, *new, *patch;
+	size_t olen, nlen, len = 0;
+	uint32_t len32, crc;
+
+	old = plain_of(base, &olen, key);
+	new = plain_of(target, &nlen, key);
+	patch = &p[offsetof(struct deltaimg_t, data)];
+	if (old != NULL && new != NULL)
+		len = diff(patch, old, olen, new, nlen);
+	free(old);
+	free(new);
+	if (!len)
+		return 0;
+
+	len32 = (uint32_t)len;
+	memcpy(&p[offsetof(struct deltaimg_t, magic)], magic, sizeof(magic));
+	memcpy(&p[offsetof(struct deltaimg_t, len)], &len32, sizeof(len32));
+	memcpy(&p[offsetof(struct deltaimg_t, iv)], iv, INITIAL_VECTOR_SIZE);
+	memcpy(&p[offsetof(struct deltaimg_t, base)],
+			(const uint8_t *)base + offsetof(struct appimg_t, plain),
+			HASH_SIZE);
+	len32 = (uint32_t)olen;
+	memcpy(&p[offsetof(struct deltaimg_t, base_len)], &len32,
+			sizeof(len32));
+	memcpy(&p[offsetof(struct deltaimg_t, target)], target,
+			sizeof(struct appimg_t));
+
+	memcpy(ctr, iv, sizeof(ctr));
+	tc_aes128_set_encrypt_key(&aes, key->aes);
+	if (!tc_ctr_mode(patch, len, patch, len, ctr, &aes))
+		return 0;
+
+	tc_sha256_init(&sha256);
+	tc_sha256_update(&sha256, patch, len);
+	tc_sha256_final(digest, &sha256);
+	if (sign(&p[offsetof(struct deltaimg_t, hash)], digest, key))
+		return 0;
+	crc = crc32(patch, len);
+	memcpy(&p[offsetof(struct deltaimg_t, crc)], &crc, sizeof(crc));
+
+	return sizeof(struct deltaimg_t) + len;
+}
@@ -0,0 +1,36 @@
+#ifndef __MKIMG_H__
+#define __MKIMG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct mkimg_key {
+	uint8_t aes[16];
+	uint8_t priv[32]; /* the seed for Ed25519 */
+	uint8_t pub[64]; /* 32 bytes of it for Ed25519 */
+};
+
+int mkimg_keygen(struct mkimg_key *key);
+
+/* Bytes needed to hold an image of `len` bytes of payload, at most when
+ * compressed. */
+size_t mkimg_size(size_t len);
+/* Encrypts `data` into `out` as laid out by struct appimg_t, signing both
+ * the plaintext and the ciphertext. With IMG_LZ4 in `flags` it is
+ * compressed first, or with IMG_SPARSE runs of erased bytes are left out,
+ * either unless that does not make it smaller.
+ * Returns the image size or 0 on error. */
+size_t mkimg(void *out, const void *data, size_t len, const uint8_t *iv,
+		uint32_t flags, const struct mkimg_key *key);
+
+/* Bytes needed at most to hold a delta to an image of `len` bytes of
+ * payload. */
+size_t mkdelta_size(size_t len);
+/* Diffs the payload of image `target` against the one of image `base`, both
+ * as mkimg() made them with `key` and not compressed, into `out` as laid out by struct
+ * deltaimg_t, Patch encrypted with `iv` and signed.
+ * Returns the delta size or 0 on error. */
+size_t mkdelta(void *out, const void *base, const void *target,
+		const uint8_t *iv, const struct mkimg_key *key);
+
+#endif /* __MKIMG_H__ */
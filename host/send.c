@@ -0,0 +1,288 @@
+#include "send.h"
+#include "download.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYNC_MS			10000 /* for the bootloader to come up */
+#define ACK_MS			2000
+#define END_MS			30000 /* verifying the whole image */
+
+struct frame {
+	uint8_t type;
+	uint8_t seq;
+	uint16_t len;
+	uint8_t payload[8];
+};
+
+static struct {
+	int state;
+	size_t n;
+	uint16_t crc, rxcrc;
+	struct frame f;
+} rx;
+
+static uint16_t crc16(uint16_t crc, uint8_t c)
+{
+	crc ^= (uint16_t)(c << 8);
+	for (int i = 0; i < 8; i++)
+		crc = (crc & 0x8000)? (uint16_t)((crc << 1) ^ 0x1021) :
+			(uint16_t)(crc << 1);
+
+	return crc;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int put(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				poll(&pfd, 1, 10);
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+static int send(int fd, uint8_t type, uint8_t seq, const uint8_t *hdr,
+		size_t hlen, const uint8_t *data, size_t dlen)
+{
+	uint8_t buf[1 + 4 + 4 + DL_DATA_MAX + 2];
+	size_t len = hlen + dlen, n = 0;
+	uint16_t crc = 0xffff;
+
+	buf[n++] = DL_SOF;
+	buf[n++] = type;
+	buf[n++] = seq;
+	buf[n++] = (uint8_t)len;
+	buf[n++] = (uint8_t)(len >> 8);
+	memcpy(&buf[n], hdr, hlen);
+	n += hlen;
+	memcpy(&buf[n], data, dlen);
+	n += dlen;
+	for (size_t i = 1; i < n; i++)
+		crc = crc16(crc, buf[i]);
+	buf[n++] = (uint8_t)crc;
+	buf[n++] = (uint8_t)(crc >> 8);
+
+	return put(fd, buf, n);
+}
+
+/* Returns 1 with a frame in rx.f, 0 on the byte going to the log */
+static int parse(uint8_t c)
+{
+	switch (rx.state) {
+	case 0:
+		if (c != DL_SOF)
+			return 0;
+		rx.crc = 0xffff;
+		rx.state = 1;
+		return -1;
+	case 1:
+		rx.f.type = c;
+		break;
+	case 2:
+		rx.f.seq = c;
+		break;
+	case 3:
+		rx.f.len = c;
+		break;
+	case 4:
+		rx.f.len |= (uint16_t)(c << 8);
+		rx.n = 0;
+		if (rx.f.len > sizeof(rx.f.payload)) {
+			rx.state = 0;
+			return -1;
+		}
+		rx.state = rx.f.len? 5 : 6;
+		rx.crc = crc16(rx.crc, c);
+		return -1;
+	case 5:
+		rx.f.payload[rx.n++] = c;
+		rx.crc = crc16(rx.crc, c);
+		if (rx.n == rx.f.len)
+			rx.state = 6;
+		return -1;
+	case 6:
+		rx.rxcrc = c;
+		rx.state = 7;
+		return -1;
+	default:
+		rx.state = 0;
+		return (uint16_t)(rx.rxcrc | (c << 8)) == rx.crc? 1 : -1;
+	}
+
+	rx.crc = crc16(rx.crc, c);
+	rx.state++;
+	return -1;
+}
+
+/* Waits up to `ms` for a frame from the bootloader */
+static int recv_frame(int fd, int ms, FILE *log)
+{
+	long long deadline = now_ms() + ms;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint8_t c;
+	int left, r;
+
+	while ((left = (int)(deadline - now_ms())) >= 0) {
+		if (poll(&pfd, 1, left) <= 0)
+			continue;
+		if (read(fd, &c, 1) != 1)
+			continue;
+		if ((r = parse(c)) > 0)
+			return 1;
+		if (r == 0 && log)
+			fputc(c, log);
+	}
+
+	return 0;
+}
+
+int send_image(int fd, const void *img, size_t len, FILE *log,
+		struct send_stats *stats)
+{
+	const uint8_t *p = (const uint8_t *)img;
+	size_t max, nframes, acked, sent, i;
+	long long deadline;
+	unsigned int window;
+	uint8_t hdr[4], seq;
+	int tries;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&rx, 0, sizeof(rx));
+
+	hdr[0] = (uint8_t)len;
+	hdr[1] = (uint8_t)(len >> 8);
+	hdr[2] = (uint8_t)(len >> 16);
+	hdr[3] = (uint8_t)(len >> 24);
+
+	/* back to back, for the bootloader to find on the line at reset */
+	for (deadline = now_ms() + SYNC_MS; ; ) {
+		if (now_ms() > deadline)
+			return -1;
+		if (send(fd, DL_START, 0, hdr, 4, NULL, 0))
+			return -1;
+		if (recv_frame(fd, 1, log) &&
+				rx.f.type == DL_ACK && rx.f.seq == 0)
+			break;
+	}
+	if (rx.f.payload[0] != DL_OK || rx.f.len < 4)
+		return rx.f.payload[0];
+
+	window = rx.f.payload[1];
+	max = (size_t)rx.f.payload[2] | ((size_t)rx.f.payload[3] << 8);
+	if (!window || !max || max > DL_DATA_MAX || (max & 3))
+		return -1;
+
+	/* frame i carries offset i * max with seq i + 1 */
+	nframes = (len + max - 1) / max;
+	acked = sent = 0;
+
+	while (acked < nframes) {
+		while (sent < nframes && sent - acked < window) {
+			size_t off = sent * max;
+			size_t n = len - off < max? len - off : max;
+
+			hdr[0] = (uint8_t)off;
+			hdr[1] = (uint8_t)(off >> 8);
+			hdr[2] = (uint8_t)(off >> 16);
+			hdr[3] = (uint8_t)(off >> 24);
+			if (send(fd, DL_DATA, (uint8_t)(sent + 1), hdr, 4,
+						&p[off], n))
+				return -1;
+			sent++;
+			stats->frames++;
+		}
+
+		if (!recv_frame(fd, ACK_MS, log)) {
+			stats->timeouts++;
+			stats->resent += sent - acked;
+			sent = acked;
+			continue;
+		}
+
+		/* seq of the frames in flight, acked + 1 through sent */
+		for (i = acked; i < sent; i++) {
+			if ((uint8_t)(i + 1) == rx.f.seq)
+				break;
+		}
+		if (i == sent)
+			continue; /* stale */
+
+		if (rx.f.type == DL_ACK) {
+			if (rx.f.payload[0] != DL_OK)
+				return rx.f.payload[0];
+			acked = i + 1;
+		} else if (rx.f.type == DL_NAK) {
+			stats->naks++;
+			stats->resent += sent - i;
+			acked = i;
+			sent = i;
+		}
+	}
+
+	seq = (uint8_t)(nframes + 1);
+	for (tries = 0; tries < 3; tries++) {
+		if (send(fd, DL_END, seq, NULL, 0, NULL, 0))
+			return -1;
+		while (recv_frame(fd, END_MS, log)) {
+			if (rx.f.type == DL_ACK && rx.f.seq == seq)
+				return rx.f.payload[0];
+			if (rx.f.type == DL_NAK && rx.f.seq == seq)
+				break;
+		}
+	}
+
+	return -1;
+}
+
+int send_setup_tty(int fd, unsigned long baud)
+{
+	struct termios tio;
+	speed_t speed;
+
+	switch (baud) {
+	case 9600: speed = B9600; break;
+	case 19200: speed = B19200; break;
+	case 38400: speed = B38400; break;
+	case 57600: speed = B57600; break;
+	case 115200: speed = B115200; break;
+	case 230400: speed = B230400; break;
+	case 460800: speed = B460800; break;
+	case 921600: speed = B921600; break;
+	default: return -1;
+	}
+
+	if (tcgetattr(fd, &tio))
+		return -1;
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+
+	return tcsetattr(fd, TCSANOW, &tio);
+}
@@ -0,0 +1,24 @@
+#ifndef __SEND_H__
+#define __SEND_H__
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct send_stats {
+	size_t frames;
+	size_t resent;
+	size_t naks;
+	size_t timeouts;
+};
+
+/* Sends an image to the bootloader in download mode on `fd`, the protocol
+ * being the one of download.h. What comes from the bootloader between
+ * frames goes to `log` unless NULL.
+ * Returns 0 once the image is acknowledged, the DL_ status it was refused
+ * with, or -1 when the bootloader gives no answer. */
+int send_image(int fd, const void *img, size_t len, FILE *log,
+		struct send_stats *stats);
+/* Raw 8N1 at `baud` for a serial port, a pty taking any */
+int send_setup_tty(int fd, unsigned long baud);
+
+#endif /* __SEND_H__ */
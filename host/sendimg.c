@@ -0,0 +1,73 @@
+#include "send.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long baud = 115200;
+	struct send_stats stats;
+	struct stat st;
+	FILE *log = NULL;
+	void *img;
+	double t;
+	int opt, fd, err;
+
+	while ((opt = getopt(argc, argv, "b:v")) != -1) {
+		switch (opt) {
+		case 'b':
+			baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			log = stderr;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 2)
+		goto usage;
+
+	if ((fd = open(argv[optind + 1], O_RDONLY)) < 0 || fstat(fd, &st) ||
+			(img = malloc((size_t)st.st_size)) == NULL ||
+			read(fd, img, (size_t)st.st_size) != st.st_size) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	close(fd);
+
+	if ((fd = open(argv[optind], O_RDWR | O_NOCTTY)) < 0 ||
+			send_setup_tty(fd, baud)) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	t = now();
+	err = send_image(fd, img, (size_t)st.st_size, log, &stats);
+	t = now() - t;
+
+	printf("%s: %ld bytes in %.2f s, %.0f B/s, %zu frames, "
+			"%zu resent, %zu naks, %zu timeouts\n",
+			err? "failed" : "done", (long)st.st_size, t,
+			(double)st.st_size / t, stats.frames, stats.resent,
+			stats.naks, stats.timeouts);
+	if (err > 0)
+		printf("refused with status %d\n", err);
+
+	return !!err;
+
+usage:
+	fprintf(stderr, "usage: %s [-b baud] [-v] tty image\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,91 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdint.h>
+
+#define MAGIC1				0xDEC0ADDE
+#define MAGIC2				0xDEC1ADDE
+#define MAGIC3				0xDEC2ADDE
+#define MAGIC3_DELTA			0xDEC3ADDE
+
+#define IMG_LZ4				(1U << 0) /* Data compressed, see lz.h */
+#define IMG_SPARSE			(1U << 1) /* Data in segments, see below */
+
+#define HASH_SIZE			64
+#define INITIAL_VECTOR_SIZE		16
+
+struct appimg_t {
+	const uint32_t magic[3];
+	const uint32_t len; /* of Data */
+	const uint8_t iv[INITIAL_VECTOR_SIZE];
+	union {
+		struct {
+			const uint8_t r[32];
+			const uint8_t s[32];
+		} ecdsa;
+		const uint8_t hash[HASH_SIZE]; /* of E(Data) */
+	};
+	const uint8_t plain[HASH_SIZE]; /* signed HASH(Data) */
+	const uint32_t crc; /* CRC32(E(Data)), a quick check before HASH */
+	const uint32_t plain_crc; /* CRC32(Data) */
+	const uint32_t flags;
+	const uint32_t size; /* of E(Data) as staged, LEN unless compressed */
+	const uint8_t data[];
+} __attribute__((packed, aligned(4)));
+
+/* Data of an IMG_SPARSE image is staged as a word telling how many segments
+ * there are, a table of them in order of offset, and E(Data) of the segments
+ * back to back, the counter running on across them. What lies between them
+ * is left erased, to be downloaded, decrypted and programmed not at all, and
+ * hashed only as Data read back from flash. The table goes into HASH* along
+ * with E(Data), as it is staged. */
+struct segment_t {
+	const uint32_t offset; /* into Data */
+	const uint32_t len;
+} __attribute__((packed, aligned(4)));
+
+/* A delta staged in place of an image. It lines up with struct appimg_t up
+ * to CRC, so that BootOpt points to it the same way, and Patch makes the
+ * image `target` is the header of out of the app `base` is the header of. */
+struct deltaimg_t {
+	const uint32_t magic[3];
+	const uint32_t len; /* of E(Patch) */
+	const uint8_t iv[INITIAL_VECTOR_SIZE];
+	const uint8_t hash[HASH_SIZE]; /* signed HASH(E(Patch)) */
+	const uint8_t base[HASH_SIZE]; /* PLAIN of the app it goes on */
+	const uint32_t crc; /* CRC32(E(Patch)) */
+	const uint32_t base_len; /* LEN of the app it goes on */
+	const struct appimg_t target;
+	const uint8_t data[];
+} __attribute__((packed, aligned(4)));
+
+struct bootopt_t {
+	const uint32_t addr;
+	const uint32_t len;
+	union {
+		struct {
+			const uint8_t r[32];
+			const uint8_t s[32];
+		} ecdsa;
+		const uint8_t hash[HASH_SIZE];
+	};
+	const uint8_t iv[INITIAL_VECTOR_SIZE];
+	const uint8_t plain[HASH_SIZE];
+} __attribute__((packed, aligned(4)));
+
+/* Verified-boot token follows BootOpt in the same sector */
+#define BOOTOPT_TOKEN_OFFSET		sizeof(struct bootopt_t)
+#define BOOTOPT_TOKEN_SIZE		32
+
+/* Install journal takes the rest of the sector: a word per sector of the
+ * app region, zeroed once the sector is programmed and verified, followed
+ * by checkpoints of the digests. `offset` is written last so that a torn
+ * checkpoint stays blank. */
+#define BOOTOPT_JOURNAL_OFFSET		(BOOTOPT_TOKEN_OFFSET + BOOTOPT_TOKEN_SIZE)
+
+struct journal_ckpt_t {
+	uint32_t plain[8]; /* HASH(Data) state */
+	uint32_t offset; /* of Data hashed so far */
+} __attribute__((packed, aligned(4)));
+
+#endif /* __IMAGE_H__ */
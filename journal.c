@@ -0,0 +1,113 @@
+#include "bsp.h"
+#include "flash.h"
+#include "journal.h"
+
+#include <string.h>
+
+#define BLANK			0xffffffffUL
+
+static int count_sectors(uintptr_t start, size_t len)
+{
+	uintptr_t addr = start, end = start + len;
+	unsigned int ss;
+	int n;
+
+	for (n = 0; addr < end; n++) {
+		ss = (unsigned int)get_sector_size_kb(addr2sector((void *)addr)) << 10;
+		if (!ss)
+			return 0;
+		addr = BASE_ALIGN(addr, ss) + ss;
+	}
+
+	return n;
+}
+
+void journal_open(struct journal *journal, const struct bootopt_t *bootopt,
+		size_t sector_size, uintptr_t app, size_t len)
+{
+	uintptr_t start = (uintptr_t)bootopt + BOOTOPT_JOURNAL_OFFSET;
+	uintptr_t end = (uintptr_t)bootopt + sector_size;
+	int nmarks;
+
+	memset(journal, 0, sizeof(*journal));
+
+	nmarks = count_sectors(app, len);
+	if (!nmarks || start + (unsigned int)nmarks * 4 >= end)
+		return;
+
+	journal->mark = (const uint32_t *)start;
+	journal->ckpt = (const struct journal_ckpt_t *)&journal->mark[nmarks];
+	journal->nckpts = (int)((end - (uintptr_t)journal->ckpt) /
+			sizeof(struct journal_ckpt_t));
+	if (!journal->nckpts)
+		return;
+
+	journal->nmarks = nmarks;
+	journal->interval = (nmarks + journal->nckpts - 1) / journal->nckpts;
+}
+
+int journal_first_incomplete(const struct journal *journal)
+{
+	int i;
+
+	for (i = 0; i < journal->nmarks && journal->mark[i] == 0; i++)
+		;
+
+	return i;
+}
+
+void journal_done(const struct journal *journal, int sector)
+{
+	const uint32_t zero = 0;
+
+	if (sector >= journal->nmarks || journal->mark[sector] != BLANK)
+		return;
+
+	flash_program((void *)&journal->mark[sector], &zero, sizeof(zero));
+}
+
+void journal_checkpoint(const struct journal *journal, int sector,
+		uint32_t offset, const struct hash_state *plain)
+{
+	struct journal_ckpt_t ckpt;
+	const struct journal_ckpt_t *slot;
+	int n;
+
+	if (!journal->nmarks || (sector + 1) % journal->interval)
+		return;
+
+	n = (sector + 1) / journal->interval - 1;
+	if (n >= journal->nckpts)
+		return;
+
+	slot = &journal->ckpt[n];
+	if (slot->offset != BLANK)
+		return;
+
+	/* only taken at sector boundaries where nothing is left over */
+	memcpy(ckpt.plain, hash_chain(plain), sizeof(ckpt.plain));
+	ckpt.offset = offset;
+
+	flash_program((void *)slot, &ckpt, sizeof(ckpt));
+}
+
+uint32_t journal_restore(const struct journal *journal, uint32_t offset,
+		struct hash_state *plain)
+{
+	const struct journal_ckpt_t *last = NULL;
+
+	hash_init(plain);
+
+	for (int i = 0; i < journal->nmarks && i < journal->nckpts; i++) {
+		if (journal->ckpt[i].offset > offset)
+			break;
+		last = &journal->ckpt[i];
+	}
+
+	if (!last)
+		return 0;
+
+	hash_resume(plain, last->plain, last->offset);
+
+	return last->offset;
+}
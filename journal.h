@@ -0,0 +1,30 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "image.h"
+#include "hash.h"
+
+#include <stddef.h>
+
+struct journal {
+	const uint32_t *mark;
+	const struct journal_ckpt_t *ckpt;
+	int nmarks;
+	int nckpts;
+	int interval; /* checkpoint every this many sectors */
+};
+
+/* `len` covers the app region to be written including its header. The
+ * journal is disabled, all the calls being no-op, when it doesn't fit. */
+void journal_open(struct journal *journal, const struct bootopt_t *bootopt,
+		size_t sector_size, uintptr_t app, size_t len);
+int journal_first_incomplete(const struct journal *journal);
+void journal_done(const struct journal *journal, int sector);
+void journal_checkpoint(const struct journal *journal, int sector,
+		uint32_t offset, const struct hash_state *plain);
+/* Restores the latest checkpoint at or below `offset` and returns the
+ * offset it was taken at, 0 with the initial state if there is none. */
+uint32_t journal_restore(const struct journal *journal, uint32_t offset,
+		struct hash_state *plain);
+
+#endif /* __JOURNAL_H__ */
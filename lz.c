@@ -0,0 +1,143 @@
+#if defined(LZ4)
+#include "lz.h"
+#include "bsp.h"
+
+#include <string.h>
+
+_Static_assert(LZ_BLOCK_SIZE % CTR_BLOCK_SIZE == 0,
+		"LZ_BLOCK_SIZE must be a multiple of the AES block");
+
+enum {
+	LZ_TOKEN,
+	LZ_LITLEN,
+	LZ_LITERAL,
+	LZ_OFFSET0,
+	LZ_OFFSET1,
+	LZ_MATCHLEN,
+	LZ_MATCH,
+	LZ_END,
+	LZ_BAD,
+};
+
+void lz_init(struct lz *lz, const uint8_t *src, size_t len,
+		const uint8_t *iv, const struct ctr_key *key)
+{
+	lz->src = src;
+	lz->end = src + len;
+	memcpy(lz->ctr, iv, sizeof(lz->ctr));
+	lz->key = key;
+	lz->pos = lz->n = 0;
+	lz->total = 0;
+	lz->state = LZ_TOKEN;
+}
+
+static int refill(struct lz *lz)
+{
+	if (lz->pos < lz->n)
+		return 0;
+	if (lz->src == lz->end)
+		return -1;
+
+	lz->n = min((size_t)(lz->end - lz->src), sizeof(lz->buf));
+	ctr_crypt(lz->buf, lz->src, lz->n, lz->ctr, lz->key);
+	lz->src += lz->n;
+	lz->pos = 0;
+
+	return 0;
+}
+
+static int get(struct lz *lz)
+{
+	if (refill(lz))
+		return -1;
+
+	return lz->buf[lz->pos++];
+}
+
+static inline int ended(const struct lz *lz)
+{
+	return lz->pos == lz->n && lz->src == lz->end;
+}
+
+/* whether what comes next takes room in the output */
+static inline int pending(const struct lz *lz)
+{
+	return lz->state == LZ_MATCH || (lz->state == LZ_LITERAL && lz->lit);
+}
+
+size_t lz_read(struct lz *lz, uint8_t *buf, size_t len, const uint8_t *dst)
+{
+	size_t o = 0, n;
+	ptrdiff_t s;
+	int c = 0;
+
+	while (lz->state < LZ_END && (o < len || !pending(lz))) {
+		if (lz->state != LZ_LITERAL && lz->state != LZ_MATCH &&
+				(c = get(lz)) < 0) {
+			lz->state = LZ_BAD;
+			break;
+		}
+
+		switch (lz->state) {
+		case LZ_TOKEN:
+			lz->lit = (uint32_t)c >> 4;
+			lz->match = (uint32_t)c & 15;
+			lz->state = lz->lit == 15? LZ_LITLEN : LZ_LITERAL;
+			break;
+		case LZ_LITLEN:
+			lz->lit += (uint32_t)c;
+			if (c != 255)
+				lz->state = LZ_LITERAL;
+			break;
+		case LZ_LITERAL:
+			if (!lz->lit) {
+				lz->state = ended(lz)? LZ_END : LZ_OFFSET0;
+				break;
+			}
+			if (refill(lz)) {
+				lz->state = LZ_BAD;
+				break;
+			}
+			n = min((size_t)lz->lit, len - o);
+			n = min(n, lz->n - lz->pos);
+			memcpy(&buf[o], &lz->buf[lz->pos], n);
+			lz->pos += n;
+			lz->lit -= (uint32_t)n;
+			o += n;
+			break;
+		case LZ_OFFSET0:
+			lz->dist = (uint32_t)c;
+			lz->state = LZ_OFFSET1;
+			break;
+		case LZ_OFFSET1:
+			lz->dist |= (uint32_t)c << 8;
+			if (!lz->dist || lz->dist > lz->total + o) {
+				lz->state = LZ_BAD;
+				break;
+			}
+			lz->state = lz->match == 15? LZ_MATCHLEN : LZ_MATCH;
+			lz->match += 4;
+			break;
+		case LZ_MATCHLEN:
+			lz->match += (uint32_t)c;
+			if (c != 255)
+				lz->state = LZ_MATCH;
+			break;
+		case LZ_MATCH:
+			n = min((size_t)lz->match, len - o);
+			lz->match -= (uint32_t)n;
+			for (; n; n--, o++) {
+				s = (ptrdiff_t)o - (ptrdiff_t)lz->dist;
+				buf[o] = s < 0? dst[s] : buf[s];
+			}
+			if (!lz->match)
+				lz->state = LZ_TOKEN;
+			break;
+		}
+	}
+
+	lz->total += (uint32_t)o;
+
+	return o;
+}
+#endif /* LZ4 */
@@ -0,0 +1,39 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include "ctr.h"
+#include "hash.h"
+#include "image.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_BLOCK_SIZE			64 /* of E(Data) decrypted at once */
+
+/* Data of an IMG_LZ4 image is one LZ4 block, sequences of literals and a
+ * match up to 64KB back, the last of literals alone. The window is what is
+ * in flash already, right before where the output goes, so it takes no RAM
+ * whatever its size. */
+struct lz {
+	const uint8_t *src, *end;
+	uint8_t ctr[INITIAL_VECTOR_SIZE];
+	const struct ctr_key *key;
+	uint8_t buf[LZ_BLOCK_SIZE];
+	size_t pos, n;
+	uint32_t total; /* produced so far */
+	uint32_t lit, match, dist;
+	int state;
+};
+
+#if defined(LZ4)
+void lz_init(struct lz *lz, const uint8_t *src, size_t len,
+		const uint8_t *iv, const struct ctr_key *key);
+/* Decompresses the next `len` bytes into `buf`, bound for `dst` in flash
+ * where all that came before is already, and goes on taking in what makes
+ * no output, so that the block is taken in to its end with the last of
+ * Data. Returns how many it made, fewer only when the block ends or turns
+ * out malformed. */
+size_t lz_read(struct lz *lz, uint8_t *buf, size_t len, const uint8_t *dst);
+#endif
+
+#endif /* __LZ_H__ */
@@ -1,56 +1,63 @@
 #include "bsp.h"
 #include "flash.h"
-#include "tinycrypt/sha256.h"
+#include "image.h"
+#include "bootcache.h"
+#include "journal.h"
+#include "download.h"
+#include "delta.h"
+#include "hash.h"
 #include "tinycrypt/ecc_dsa.h"
-#include "tinycrypt/ctr_mode.h"
-#include "tinycrypt/aes.h"
+#include "ed25519.h"
+#include "ctr.h"
+#include "crc.h"
+#include "lz.h"
 #include "uart.h"
+#include "clock.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 
-#define MAGIC1				0xDEC0ADDE
-#define MAGIC2				0xDEC1ADDE
-#define MAGIC3				0xDEC2ADDE
+#if !defined(CHUNK_SIZE)
+#define CHUNK_SIZE			1024 /* decrypted and programmed at once */
+#endif
+#if !defined(STACK_SIZE)
+#define STACK_SIZE			4096
+#endif
+/* what install() and verify_digest() take besides the chunk, the signature
+ * check mostly */
+#define STACK_RESERVED			2048
 
-#define HASH_SIZE			64
-#define INITIAL_VECTOR_SIZE		16
+#if defined(LZ4)
+#define IMG_FLAGS_LZ4			IMG_LZ4
+#else
+#define IMG_FLAGS_LZ4			0
+#endif
+#if defined(SPARSE)
+#define IMG_FLAGS_SPARSE		IMG_SPARSE
+#else
+#define IMG_FLAGS_SPARSE		0
+#endif
+/* what this build installs */
+#define IMG_FLAGS			(IMG_FLAGS_LZ4 | IMG_FLAGS_SPARSE)
+
+_Static_assert(CHUNK_SIZE % CTR_BLOCK_SIZE == 0,
+		"CHUNK_SIZE must be a multiple of the AES block");
+_Static_assert(CHUNK_SIZE + STACK_RESERVED <= STACK_SIZE,
+		"CHUNK_SIZE does not fit in STACK_SIZE");
 
 #define error(msg)			uart_puts("ERROR : "msg"\r\n")
 #define warn(msg)			uart_puts("WARN  : "msg"\r\n")
 #define notice(msg)			uart_puts("NOTICE: "msg"\r\n")
 
-struct appimg_t {
-	const uint32_t magic[3];
-	const size_t len;
-	const uint8_t iv[INITIAL_VECTOR_SIZE];
-	union {
-		struct {
-			const uint8_t r[32];
-			const uint8_t s[32];
-		} ecdsa;
-		const uint8_t hash[HASH_SIZE];
-	};
-	const uint8_t data[];
-} __attribute__((packed, aligned(4)));
-
-struct bootopt_t {
-	const uintptr_t addr;
-	const size_t len;
-	union {
-		struct {
-			const uint8_t r[32];
-			const uint8_t s[32];
-		} ecdsa;
-		const uint8_t hash[HASH_SIZE];
-	};
-	const uint8_t iv[INITIAL_VECTOR_SIZE];
-} __attribute__((packed, aligned(4)));
-
-extern char _sector_size;
+extern char _sector_size, _rom_start;
+extern char _pubkey, _aeskey, _app, _staging, _slot_b, _scratch;
+extern struct bootopt_t _bootopt;
 
 static void reboot(void)
 {
+	uart_flush();
 	dsb();
 	isb();
 
@@ -58,34 +65,41 @@ static void reboot(void)
 	SCB_AIRCR = (VECTKEY << 16)
 		| (SCB_AIRCR & (7 << 8)) /* keep priority group unchanged */
 		| (1 << 2); /* system reset request */
+	dsb();
+#if defined(HOST)
+	emu_halt(EMU_HALT_REBOOT, 0);
+#endif
+	while (1);
 }
 
-static int verify(const uint8_t *signature, const uint8_t *data, uint32_t len,
+static int verify_digest(const uint8_t *signature, const uint8_t *digest,
 		const void *eckey)
 {
 	const uint8_t *pubkey = eckey;
-	struct tc_sha256_state_struct sha256_ctx;
-	uint8_t digest[TC_SHA256_DIGEST_SIZE];
-
-	notice("Verify");
-
-	tc_sha256_init(&sha256_ctx);
-	tc_sha256_update(&sha256_ctx, data, len);
-	tc_sha256_final(digest, &sha256_ctx);
+	uint32_t t0;
+	int err;
 
 #ifdef DEBUG
 	char t[10];
 	uart_puts("SHA256: ");
-	for (int i = 0; i < TC_SHA256_DIGEST_SIZE; i++) {
+	for (int i = 0; i < HASH_DIGEST_SIZE; i++) {
 		itoa(digest[i], t, 16);
 		uart_puts(t);
 	}
 	uart_puts("\r\n");
 #endif
 
-	if (uECC_valid_public_key(pubkey, uECC_secp256r1()) != 0)
-		error("Public key is not valid");
-	if (!uECC_verify(pubkey, digest, sizeof(digest), signature, uECC_secp256r1())) {
+	/* The key is checked to be valid when provisioned, mkimg_keygen()
+	 * on the host, and is part of the bootloader image from then on. */
+	t0 = trace_begin();
+#if defined(ED25519)
+	err = ed25519_verify(signature, digest, HASH_DIGEST_SIZE, pubkey);
+#else
+	err = !uECC_verify(pubkey, digest, HASH_DIGEST_SIZE, signature,
+			uECC_secp256r1());
+#endif
+	trace_end(TRACE_SIG, t0);
+	if (err) {
 		error("Verify failed");
 		return -1;
 	}
@@ -93,44 +107,100 @@ static int verify(const uint8_t *signature, const uint8_t *data, uint32_t len,
 	return 0;
 }
 
-static int verify_enc(const uint8_t *signature, const uint8_t *data, uint32_t len,
-		const void *eckey, const void *aeskey, const void *aesiv)
+static int verify(const uint8_t *signature, const uint8_t *data, uint32_t len,
+		const void *eckey)
 {
-	struct tc_aes_key_sched_struct ctx;
-	uint8_t buf[(int)&_sector_size], iv[INITIAL_VECTOR_SIZE];
-	int size;
-	const uint8_t *pubkey = eckey;
-	const uint8_t *key = aeskey;
+	struct hash_state sha256_ctx;
+	uint8_t digest[HASH_DIGEST_SIZE];
+	uint32_t t0;
 
-	struct tc_sha256_state_struct sha256_ctx;
-	uint8_t digest[TC_SHA256_DIGEST_SIZE];
+	notice("Verify");
 
-	notice("Verify(E)");
+	t0 = trace_begin();
+	hash_init(&sha256_ctx);
+	hash_update(&sha256_ctx, data, len);
+	hash_final(&sha256_ctx, digest);
+	trace_end(TRACE_SHA, t0);
 
-	tc_aes128_set_encrypt_key(&ctx, key);
-	memcpy(iv, aesiv, sizeof(iv));
-	tc_sha256_init(&sha256_ctx);
+	return verify_digest(signature, digest, eckey);
+}
 
-	for (uint32_t i = 0; i < len; i += (uint32_t)&_sector_size) {
-		size = ((len - i) < (uint32_t)&_sector_size)?
-			len - i : (uint32_t)&_sector_size;
-		tc_ctr_mode(buf, size, &data[i], size, iv, &ctx);
+/* Of a staged image, HASH* taking LEN and FLAGS after E(Data), so that
+ * what E(Data) makes can not be changed either */
+static int verify_staged(const struct appimg_t *img, const void *eckey)
+{
+	struct hash_state sha256_ctx;
+	uint8_t digest[HASH_DIGEST_SIZE];
+	uint32_t t0;
 
-		tc_sha256_update(&sha256_ctx, buf, size);
-	}
+	notice("Verify");
 
-	tc_sha256_final(digest, &sha256_ctx);
+	t0 = trace_begin();
+	hash_init(&sha256_ctx);
+	hash_update(&sha256_ctx, img->data, img->size);
+	hash_update(&sha256_ctx, &img->len, sizeof(img->len));
+	hash_update(&sha256_ctx, &img->flags, sizeof(img->flags));
+	hash_final(&sha256_ctx, digest);
+	trace_end(TRACE_SHA, t0);
 
-	if (uECC_valid_public_key(pubkey, uECC_secp256r1()) != 0)
-		error("Public key is not valid");
-	if (!uECC_verify(pubkey, digest, sizeof(digest), signature, uECC_secp256r1())) {
-		error("Verify failed");
+	return verify_digest(img->hash, digest, eckey);
+}
+
+/* Whether this build installs Data laid out the way FLAGS tell, one way at
+ * most, and if sparse, whether the segments are in order, within LEN and
+ * add up to what is staged after the table. */
+static int check_layout(const struct appimg_t *img)
+{
+#if defined(SPARSE)
+	const struct segment_t *seg = (const struct segment_t *)&img->data[4];
+	uint32_t n, i, end, sum;
+#endif
+
+	if ((img->flags & ~IMG_FLAGS) ||
+			img->flags == (IMG_LZ4 | IMG_SPARSE))
 		return -1;
+	if (!img->flags)
+		return img->size != img->len;
+
+#if defined(SPARSE)
+	if (!(img->flags & IMG_SPARSE))
+		return 0;
+	if (img->size < sizeof(n))
+		return -1;
+	n = *(const uint32_t *)img->data;
+	if (n > (img->size - sizeof(n)) / sizeof(*seg))
+		return -1;
+	for (i = 0, end = 0, sum = 0; i < n; i++) {
+		if (seg[i].offset < end || seg[i].offset > img->len ||
+				seg[i].len > img->len - seg[i].offset)
+			return -1;
+		end = seg[i].offset + seg[i].len;
+		sum += seg[i].len;
 	}
+	if (sum != img->size - sizeof(n) - n * sizeof(*seg))
+		return -1;
+#endif
 
 	return 0;
 }
 
+/* Only ever a reason to turn an image away, it being the signature that
+ * lets one in, but it tells a corrupt one in a fraction of the time. */
+static int check_crc(uint32_t crc, const void *data, size_t len)
+{
+	uint32_t t0;
+	int err;
+
+	t0 = trace_begin();
+	err = crc32(data, len) != crc;
+	trace_end(TRACE_CRC, t0);
+
+	if (err)
+		error("CRC mismatch");
+
+	return err;
+}
+
 #if 0
 static int verify_hash(const uint8_t *hash, const uint8_t *data, size_t len)
 {
@@ -162,85 +232,666 @@ static int verify_hash(const uint8_t *hash, const uint8_t *data, size_t len)
 }
 #endif
 
-static void program(void *addr, const struct appimg_t *img, const void *aeskey)
+/* Moves the AES-CTR counter `offset` bytes ahead. Blocks are counted
+ * in the last four bytes, big endian. */
+static void ctr_seek(uint8_t *ctr, const uint8_t *iv, uint32_t offset)
 {
-	struct tc_aes_key_sched_struct ctx;
-	uint8_t buf[(int)&_sector_size], iv[INITIAL_VECTOR_SIZE];
-	int size;
+	uint32_t n;
+
+	memcpy(ctr, iv, INITIAL_VECTOR_SIZE);
+	n = ((uint32_t)ctr[12] << 24) | ((uint32_t)ctr[13] << 16)
+		| ((uint32_t)ctr[14] << 8) | ctr[15];
+	n += offset / CTR_BLOCK_SIZE;
+	ctr[12] = (uint8_t)(n >> 24);
+	ctr[13] = (uint8_t)(n >> 16);
+	ctr[14] = (uint8_t)(n >> 8);
+	ctr[15] = (uint8_t)n;
+}
+
+#if defined(SPARSE) || defined(ABSLOT)
+/* Decrypts `len` bytes `offset` into E(Data), the block it starts in
+ * through `blk` so that the counter needs no block boundary. */
+static void ctr_crypt_at(uint8_t *out, const uint8_t *in, uint32_t len,
+		const uint8_t *iv, uint32_t offset, const struct ctr_key *ctx)
+{
+	uint8_t ctr[INITIAL_VECTOR_SIZE], blk[CTR_BLOCK_SIZE];
+	uint32_t k = offset % CTR_BLOCK_SIZE, n;
+
+	ctr_seek(ctr, iv, offset);
+	if (k && len) {
+		n = min(len, (uint32_t)CTR_BLOCK_SIZE - k);
+		memset(blk, 0, sizeof(blk));
+		memcpy(&blk[k], in, n);
+		ctr_crypt(blk, blk, sizeof(blk), ctr, ctx);
+		memcpy(out, &blk[k], n);
+		out += n;
+		in += n;
+		len -= n;
+	}
+	ctr_crypt(out, in, len, ctr, ctx);
+}
+#endif
+
+#if defined(SPARSE)
+/* How far install() is into the segments of a sparse image */
+struct sparse {
+	const struct segment_t *seg, *end;
+	const uint8_t *data; /* E(Data) of the segments back to back */
+	uint32_t off; /* into it */
+	uint32_t used; /* of `seg` */
+};
+
+static void sparse_init(struct sparse *sp, const struct appimg_t *img)
+{
+	sp->seg = (const struct segment_t *)&img->data[4];
+	sp->end = sp->seg + *(const uint32_t *)img->data;
+	sp->data = (const uint8_t *)sp->end;
+	sp->off = sp->used = 0;
+}
+
+/* Fills `buf` with `len` bytes of Data from `i` on, erased but where the
+ * segments are */
+static void sparse_read(struct sparse *sp, uint8_t *buf, uint32_t i,
+		uint32_t len, const uint8_t *iv, const struct ctr_key *ctx)
+{
+	uint32_t from, n;
+
+	memset(buf, 0xff, len);
+	for (; sp->seg < sp->end && sp->seg->offset < i + len;
+			sp->seg++, sp->used = 0) {
+		from = sp->seg->offset + sp->used;
+		n = min(sp->seg->offset + sp->seg->len, i + len) - from;
+		ctr_crypt_at(&buf[from - i], &sp->data[sp->off], n, iv,
+				sp->off, ctx);
+		sp->off += n;
+		sp->used += n;
+		if (sp->used < sp->seg->len)
+			break;
+	}
+}
+#endif
+
+enum {
+	SECTOR_DIFFERS,
+	SECTOR_SAME,
+	SECTOR_BLANK,
+};
+
+/* Whether the app sector from `i` to `top` already holds what the image
+ * decrypts to there, or is blank, before anything gets erased. The one
+ * holding the end of Data is never taken as the same, the header going in
+ * after it, and neither is one of a compressed or sparse image, which has
+ * nothing to go on at `i` but what comes before. */
+static int plan_sector(const uint8_t *d, const struct appimg_t *img,
+		uint32_t i, uint32_t top, const uint8_t *iv,
+		const struct ctr_key *ctx, uint8_t *buf)
+{
+	uint8_t ctr[INITIAL_VECTOR_SIZE];
+	const uint32_t *p;
+	uint32_t size;
+
+	if (top < img->len && !(img->flags & (IMG_LZ4 | IMG_SPARSE))) {
+		memcpy(ctr, iv, sizeof(ctr));
+		for (; i < top; i += size) {
+			size = min(top - i, (uint32_t)CHUNK_SIZE);
+			ctr_crypt(buf, &img->data[i], size, ctr, ctx);
+			if (memcmp(buf, &d[i], size))
+				break;
+		}
+		if (i >= top)
+			return SECTOR_SAME;
+	}
+
+	for (p = (const uint32_t *)&d[i]; p < (const uint32_t *)&d[top]; p++) {
+		if (*p != 0xffffffffU)
+			return SECTOR_DIFFERS;
+	}
+
+	return SECTOR_BLANK;
+}
+
+/* Installs the staged image, already checked against HASH* by
+ * verify_staged(), in a single pass over it. Each chunk of E(Data) gets
+ * decrypted and programmed, and what reads back from flash goes into
+ * HASH(Data). The header is written only when that checks out against the
+ * signature, returning -EIO otherwise, the image not having made it to
+ * flash intact.
+ *
+ * Sectors programmed and verified are recorded in the journal along with
+ * checkpoints of the digest, so that an install cut off by power loss
+ * picks up from the first incomplete sector. The digest up to there is
+ * restored from the latest checkpoint and the gap hashed again, without
+ * programming. Each sector is erased before it is programmed, and the one
+ * holding the end of Data and the header is never marked but done over.
+ *
+ * A sector that already holds what it is to be programmed with is left
+ * alone, only hashed, and one that is blank is not erased, so that an
+ * update changing little of the app wears and takes little flash.
+ *
+ * A compressed image is decompressed between decryption and programming.
+ * There being no offset in
+ * it to pick up from, it resumes from the start, the sectors marked done
+ * decompressed again but not programmed.
+ *
+ * A sparse image goes the same way, each chunk erased but for the segments
+ * falling in it, which a row of flash already erased takes as nothing to
+ * program. */
+static int install(void *addr, const struct appimg_t *img, const void *eckey,
+		const void *aeskey)
+{
+	struct ctr_key ctx;
+	struct hash_state plain_ctx;
+	struct journal journal;
+	uint8_t buf[CHUNK_SIZE], iv[INITIAL_VECTOR_SIZE];
+	uint8_t digest[HASH_DIGEST_SIZE];
+	uint32_t size, i, end, ss, t0, skip;
 	uint8_t *d = (uint8_t *)addr;
 	const uint8_t *key = (const uint8_t *)aeskey;
+	int err = 0, sector, done, plan;
+#if defined(LZ4)
+	const int z = img->flags & IMG_LZ4;
+	struct lz lz;
+#else
+	const int z = 0;
+#endif
+#if defined(SPARSE)
+	const int sparse = img->flags & IMG_SPARSE;
+	struct sparse sp = { 0 };
+#else
+	const int sparse = 0;
+#endif
+	const int stream = z || sparse;
+
+	journal_open(&journal, &_bootopt, (size_t)&_sector_size,
+			(uintptr_t)addr, ((img->len + 3UL) & ~3UL)
+			+ ((uintptr_t)img->data - (uintptr_t)img));
+
+	/* offset of the first incomplete sector */
+	sector = journal_first_incomplete(&journal);
+	for (i = 0, done = 0; done < sector; done++) {
+		ss = (uint32_t)get_sector_size_kb(addr2sector(&d[i])) << 10;
+		i = BASE_ALIGN((uintptr_t)&d[i], ss) + ss - (uintptr_t)d;
+	}
+	skip = 0;
+	if (stream) {
+		skip = i;
+		i = 0;
+	}
+
+	end = journal_restore(&journal, i, &plain_ctx);
+	if (i || skip) {
+		notice("Resume");
+		hash_update(&plain_ctx, &d[end], i - end);
+	} else {
+		bootcache_invalidate(&_bootopt);
+	}
+
+	ctr_setkey(&ctx, key);
+	ctr_seek(iv, img->iv, i);
+#if defined(LZ4)
+	if (z)
+		lz_init(&lz, img->data, img->size, img->iv, &ctx);
+#endif
+#if defined(SPARSE)
+	if (sparse)
+		sparse_init(&sp, img);
+#endif
 
-	tc_aes128_set_encrypt_key(&ctx, key);
-	memcpy(iv, img->iv, sizeof(img->iv));
+	for (; i < img->len; sector++) {
+		ss = (uint32_t)get_sector_size_kb(addr2sector(&d[i])) << 10;
+		end = BASE_ALIGN((uintptr_t)&d[i], ss) + ss - (uintptr_t)d;
+		t0 = trace_begin();
+		plan = i < skip? SECTOR_SAME :
+			plan_sector(d, img, i, end, iv, &ctx, buf);
+		trace_end(TRACE_AES, t0);
+		end = min(end, img->len);
 
-	for (uint32_t i = 0; i < img->len; i += (uint32_t)&_sector_size) {
-		size = ((img->len - i) < (uint32_t)&_sector_size)?
-			img->len - i : (uint32_t)&_sector_size;
-		tc_ctr_mode(buf, size, &img->data[i], size, iv, &ctx);
-		flash_program(d, (const void * const)buf, size);
-		d += size;
+		if (plan == SECTOR_SAME && !stream) {
+			t0 = trace_begin();
+			hash_update(&plain_ctx, &d[i], end - i);
+			trace_end(TRACE_SHA, t0);
+			ctr_seek(iv, img->iv, end);
+			i = end;
+			done = 1;
+		} else if (plan != SECTOR_DIFFERS) {
+			done = 1;
+		} else { /* or left half-programmed by a previous attempt */
+			t0 = trace_begin();
+			done = !flash_erase_range(&d[i], 1);
+			trace_end(TRACE_FLASH, t0);
+		}
+
+		for (; i < end; i += size) {
+			size = min(end - i, (uint32_t)CHUNK_SIZE);
+#if defined(LZ4)
+			if (z) {
+				t0 = trace_begin();
+				if (lz_read(&lz, buf, size, &d[i]) < size)
+					done = 0;
+				trace_end(TRACE_AES, t0);
+			} else
+#endif
+#if defined(SPARSE)
+			if (sparse) {
+				t0 = trace_begin();
+				sparse_read(&sp, buf, i, size, img->iv, &ctx);
+				trace_end(TRACE_AES, t0);
+			} else
+#endif
+			{
+				t0 = trace_begin();
+				ctr_crypt(buf, &img->data[i], size, iv, &ctx);
+				trace_end(TRACE_AES, t0);
+			}
+			t0 = trace_begin();
+			if (plan != SECTOR_SAME && flash_program(&d[i],
+					(const void * const)buf, size) < size)
+				done = 0;
+			trace_end(TRACE_FLASH, t0);
+			t0 = trace_begin();
+			hash_update(&plain_ctx, &d[i], size);
+			trace_end(TRACE_SHA, t0);
 #ifdef DEBUG
-		char t[10];
-		itoa((i+size) * 100 / img->len, t, 10);
-		uart_put('\r');
-		uart_puts("Flashing : ");
-		uart_puts(t);
-		uart_put('%');
+			char t[10];
+			itoa((i+size) * 100 / img->len, t, 10);
+			uart_put('\r');
+			uart_puts("Flashing : ");
+			uart_puts(t);
+			uart_put('%');
 #endif
+		}
+
+		if (!done)
+			err = -EIO;
+		else if (i < img->len) {
+			journal_done(&journal, sector);
+			if (!stream)
+				journal_checkpoint(&journal, sector, i,
+						&plain_ctx);
+		}
 	}
+#ifdef DEBUG
+	uart_puts("\r\n");
+#endif
+
+	t0 = trace_begin();
+	hash_final(&plain_ctx, digest);
+	trace_end(TRACE_SHA, t0);
+	if (err || verify_digest(img->plain, digest, eckey))
+		return -EIO;
 
 	/* Flash meta data, MAGIC, len, IV, Hash */
-	d = (uint8_t *)(((unsigned int)d + 3UL) & ~3UL); /* 4-byte alignement */
+	d = (uint8_t *)(((unsigned int)&d[i] + 3UL) & ~3UL); /* 4-byte alignement */
 	flash_program(d, (const void * const)img, (int)img->data - (int)img);
+
+	return 0;
+}
+
+/* Zero MAGIC1 of a staged image that turned out not to be authentic, which
+ * flash allows without erasing, so that it won't be installed again. */
+static void reject(const struct appimg_t *img)
+{
+	const unsigned int zero = 0;
+
+	flash_program((void *)&img->magic[0], &zero, sizeof(zero));
 }
 
 static void update_bootopt(void *dest, void *addr, const struct appimg_t *img)
 {
-	unsigned int buf[22];
+	unsigned int buf[38];
 
 	buf[0] = (unsigned int)addr;
 	buf[1] = img->len;
 	memcpy(&buf[2], img->hash, HASH_SIZE);
 	memcpy(&buf[18], img->iv, INITIAL_VECTOR_SIZE);
+	memcpy(&buf[22], img->plain, HASH_SIZE);
 
-	flash_program(dest, buf, 22 * 4);
+	flash_program(dest, buf, 38 * 4);
 }
 
+static inline int is_header(const unsigned int *p)
+{
+	return p[0] == MAGIC1 && p[1] == MAGIC2 && p[2] == MAGIC3;
+}
+
+static inline int is_delta(const unsigned int *p)
+{
+	return p[0] == MAGIC1 && p[1] == MAGIC2 && p[2] == MAGIC3_DELTA;
+}
+
+/* The header of an installed app goes right after its data, aligned to a
+ * word, so ADDR and LEN of BootOpt tell where it is. A staged image has it
+ * at ADDR. Scanning is only for when BootOpt does not tell, e.g. a part
+ * flashed without BootOpt, and goes no further than the app region. */
 static inline struct appimg_t *get_app_header(const struct bootopt_t *bootopt,
 		unsigned int rom_end)
 {
 	unsigned int *p = (unsigned int *)bootopt->addr;
+	unsigned int end = rom_end - sizeof(struct appimg_t);
 
-	for (; (unsigned int)p < rom_end; p++) {
-		if (p[0] == MAGIC1 && p[1] == MAGIC2 && p[2] == MAGIC3)
+	if (bootopt->addr < end && bootopt->len < end - bootopt->addr) {
+		p = (unsigned int *)(bootopt->addr + ((bootopt->len + 3) & ~3));
+		if (is_header(p))
+			return (struct appimg_t *)p;
+		p = (unsigned int *)bootopt->addr;
+		if (is_header(p))
+			return (struct appimg_t *)p;
+	}
+
+	if (bootopt->addr < (unsigned int)&_staging)
+		end = (unsigned int)&_staging;
+
+	warn("Scanning for the header");
+	for (; (unsigned int)p < end; p++) {
+		if (is_header(p))
 			return (struct appimg_t *)p;
 	}
 
 	return NULL;
 }
 
+#if defined(ABSLOT)
+/* Two app slots of the same size, A at _app and B at _slot_b, the one BootOpt
+ * names booted and the other taking the next update, B ending at _scratch */
+#define SLOT_SIZE			((uintptr_t)&_scratch - (uintptr_t)&_slot_b)
+/* where an app for `slot` is linked, bank 2 showing at bank 1 once swapped */
+#if defined(stm32f4)
+#define SLOT_LINKED(slot)		((uintptr_t)&_app)
+#else
+#define SLOT_LINKED(slot)		((uintptr_t)(slot))
+#endif
+
+static inline uint32_t *booted_slot(const struct bootopt_t *bootopt)
+{
+	return bootopt->addr == (uintptr_t)&_slot_b?
+		(uint32_t *)&_slot_b : (uint32_t *)&_app;
+}
+
+static inline uint32_t *other_slot(const uint32_t *slot)
+{
+	return slot == (uint32_t *)&_app?
+		(uint32_t *)&_slot_b : (uint32_t *)&_app;
+}
+#endif
+
+#if defined(DOWNLOAD)
+#if defined(ABSLOT)
+/* An image coming in for the slot not booted gets installed on the way:
+ * the header kept in RAM, E(Data) hashed and decrypted into the slot, and
+ * the header written after Data once both signatures check out, which
+ * leaves BootOpt to point to the slot for it to boot. */
+static struct {
+	uint32_t hdr[sizeof(struct appimg_t) / 4];
+	struct hash_state enc;
+	struct ctr_key ctx;
+	int bad;
+} ab;
+
+static size_t ab_put(uint8_t *dst, uint32_t off, uint8_t *data, size_t n)
+{
+	const struct appimg_t *img = (const struct appimg_t *)ab.hdr;
+	size_t k = 0;
+
+	if (off < sizeof(ab.hdr)) {
+		k = min(n, sizeof(ab.hdr) - off);
+		memcpy((uint8_t *)ab.hdr + off, data, k);
+		if (off + k < sizeof(ab.hdr))
+			return n;
+		/* Data as it is, nothing else being unpacked on the way */
+		ab.bad = !is_header(ab.hdr) || img->flags ||
+			img->size != img->len;
+		hash_init(&ab.enc);
+		ctr_setkey(&ab.ctx, (const uint8_t *)&_aeskey);
+	}
+	if (ab.bad || k == n)
+		return n;
+
+	off = off + (uint32_t)k - (uint32_t)sizeof(ab.hdr);
+	data += k;
+	n -= k;
+	hash_update(&ab.enc, data, n);
+	ctr_crypt_at(data, data, (uint32_t)n, img->iv, off, &ab.ctx);
+
+	return k + flash_program(&dst[off], data, n);
+}
+
+static int ab_check(const void *dst, size_t len)
+{
+	const struct appimg_t *img = (const struct appimg_t *)ab.hdr;
+	const uint32_t *app = (const uint32_t *)dst;
+	uint8_t digest[HASH_DIGEST_SIZE];
+	uint8_t *p;
+
+	/* an app linked for the other slot would run the wrong one */
+	if (ab.bad || len != sizeof(ab.hdr) + img->len || img->len < 8 ||
+			app[1] - SLOT_LINKED(app) >= SLOT_SIZE)
+		return -1;
+
+	hash_update(&ab.enc, &img->len, sizeof(img->len));
+	hash_update(&ab.enc, &img->flags, sizeof(img->flags));
+	hash_final(&ab.enc, digest);
+	if (verify_digest(img->hash, digest, &_pubkey) ||
+			check_crc(img->plain_crc, dst, img->len) ||
+			verify(img->plain, dst, img->len, &_pubkey))
+		return -1;
+
+	p = (uint8_t *)dst + ((img->len + 3) & ~3UL);
+	return flash_update(p, img, sizeof(ab.hdr)) < sizeof(ab.hdr);
+}
+
+/* The new image goes to the slot not booted, installed as it comes in, and
+ * BootOpt pointing to it is all there is to commit it. */
+static void download_mode(void)
+{
+	uint32_t *slot = other_slot(booted_slot(&_bootopt));
+
+	notice("Download");
+	/* room for the header after Data rounded up to a word */
+	download(slot, SLOT_SIZE - 3, ab_check, ab_put);
+	update_bootopt(&_bootopt, slot, (const struct appimg_t *)ab.hdr);
+	reboot();
+}
+#else
+static int check_download(const void *dst, size_t len)
+{
+	const struct appimg_t *img = (const struct appimg_t *)dst;
+#if defined(DELTA)
+	const struct deltaimg_t *delta = (const struct deltaimg_t *)dst;
+
+	if (len >= sizeof(*delta) && is_delta(dst)) {
+		if (delta->len > len - sizeof(*delta) ||
+				check_crc(delta->crc, delta->data, delta->len))
+			return -1;
+		return verify(delta->hash, delta->data, delta->len, &_pubkey);
+	}
+#endif
+
+	if (len < sizeof(*img) ||
+			img->magic[0] != MAGIC1 ||
+			img->magic[1] != MAGIC2 ||
+			img->magic[2] != MAGIC3 ||
+			img->size > len - sizeof(*img) ||
+			check_layout(img) ||
+			(uintptr_t)&_app + img->len >= (uintptr_t)img)
+		return -1;
+
+	if (check_crc(img->crc, img->data, img->size))
+		return -1;
+
+	return verify_staged(img, &_pubkey);
+}
+
+/* C1 to C6: the new image comes in over the UART into the staging slot,
+ * gets verified, and BootOpt points to it for the next boot to install. */
+static void download_mode(void)
+{
+	const struct appimg_t *img = (const struct appimg_t *)&_staging;
+
+	notice("Download");
+	download(&_staging, (uintptr_t)&_scratch - (uintptr_t)&_staging,
+			check_download, NULL);
+	update_bootopt(&_bootopt, (void *)img, img);
+	reboot();
+}
+#endif
+#endif
+
 static inline void freeze(void)
 {
 	error("Freeze");
+#if defined(DOWNLOAD)
+	download_mode(); /* only a signed image gets out of here */
+#endif
+#if defined(HOST)
+	uart_flush();
+	emu_halt(EMU_HALT_FREEZE, 0);
+#endif
 	while (1);
 }
 
-void main(void)
+#if defined(ABSLOT)
+/* Nothing that checks out in the slot BootOpt names: the other one is booted
+ * if it holds an app that does, BootOpt pointing to it from then on. Its
+ * header is scanned for, BootOpt not telling where it is. */
+static void boot_failed(const uint32_t *app, uintptr_t rom_end)
+{
+	const uint32_t *slot = other_slot(app);
+	const struct bootopt_t other = {
+		.addr = (uintptr_t)slot,
+		.len = 0xffffffff,
+	};
+	const struct appimg_t *img;
+
+	if ((img = get_app_header(&other, rom_end)) != NULL &&
+			!check_crc(img->plain_crc, (const void *)other.addr,
+				img->len) &&
+			!verify(img->plain, (const uint8_t *)other.addr,
+				img->len, &_pubkey)) {
+		warn("Falling back to the other slot");
+		update_bootopt(&_bootopt, (void *)other.addr, img);
+		reboot();
+	}
+	freeze();
+}
+#else
+#define boot_failed(app, rom_end)	freeze()
+#endif
+
+#if defined(ABSLOT) && defined(stm32f4)
+/* Slot B is bank 2, where an app linked for slot A runs from once the banks
+ * are swapped. Done from RAM, the bootloader going away from under it, with
+ * the ART caches off since clock_deinit(). */
+static void __attribute__((section(".iap"), noreturn))
+run_swapped(uint32_t entry)
 {
-	extern char _pubkey, _aeskey, _rom_start, _rom_size;
-	extern struct bootopt_t _bootopt;
-	extern uintptr_t _app;
+	RCC_APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+	SYSCFG_MEMRMP |= SYSCFG_MEMRMP_FB_MODE;
+	dsb();
+	isb();
+#if defined(HOST)
+	emu_halt(EMU_HALT_RUN, entry);
+#endif
+	((void (*)(void))entry)();
+	while (1);
+}
+#endif
+
+#if defined(DELTA)
+/* Rebuilds the image a staged delta makes into the sectors following it,
+ * and points BootOpt to it once it checks out against the signature of the
+ * image, for it to be installed. Nothing of the app is touched till then,
+ * so a delta that is not for the app or does not add up is rejected and
+ * BootOpt points back to the app, `img` being its header, returning -1. */
+static int apply_delta(const struct deltaimg_t *delta, void *app,
+		uintptr_t rom_end, const struct appimg_t **img)
+{
+	const struct bootopt_t installed = {
+		.addr = (uintptr_t)app,
+		.len = delta->base_len,
+	};
+	const struct appimg_t *base, *out;
+	uintptr_t p;
+	uint32_t ss, t0;
+	int err;
+
+	notice("Apply delta");
+
+	base = get_app_header(&installed, rom_end);
+	if (base == NULL || base->len != delta->base_len ||
+			memcmp(base->plain, delta->base, HASH_SIZE)) {
+		error("Delta is not for the app");
+		goto reject;
+	}
 
+	if (delta->len >= rom_end - (uintptr_t)delta->data ||
+			check_crc(delta->crc, delta->data, delta->len))
+		goto reject;
+
+	p = (uintptr_t)&delta->data[delta->len] - 1;
+	ss = (uint32_t)get_sector_size_kb(addr2sector((void *)p)) << 10;
+	out = (const struct appimg_t *)(BASE_ALIGN(p, ss) + ss);
+	if (!is_header((const unsigned int *)&delta->target) ||
+			delta->target.flags ||
+			delta->target.len >= (uintptr_t)&_staging
+			- (uintptr_t)app ||
+			(uintptr_t)out >= rom_end ||
+			delta->target.len > rom_end - (uintptr_t)out->data)
+		goto reject;
+
+	t0 = trace_begin();
+	err = delta_apply((void *)out, delta, app, base->len, &_aeskey);
+	trace_end(TRACE_FLASH, t0);
+	if (err) {
+		error("Delta does not add up");
+		goto reject;
+	}
+	if (check_crc(out->crc, out->data, out->size) ||
+			verify_staged(out, &_pubkey))
+		goto reject;
+
+	update_bootopt(&_bootopt, (void *)out, out);
+	*img = out;
+
+	return 0;
+
+reject:
+	reject((const struct appimg_t *)delta);
+	if (base == NULL)
+		freeze();
+	update_bootopt(&_bootopt, app, base);
+	*img = base;
+
+	return -1;
+}
+#endif
+
+void main(void)
+{
 	const struct bootopt_t *bootopt;
 	const struct appimg_t *img;
-	uintptr_t *app;
+	uint32_t *app;
 	uintptr_t rom_start, rom_end;
 
 	bootopt = (struct bootopt_t *)&_bootopt;
-	app = (uintptr_t *)&_app;
+	app = (uint32_t *)&_app;
+#if defined(ABSLOT)
+	app = booted_slot(bootopt);
+#endif
 	img = NULL;
 
+	trace_init();
+	clock_init();
+	trace_mark(TRACE_CLOCK);
 	uart_init();
+	flash_set_idle(uart_poll); /* output goes on while the flash is busy */
+	trace_mark(TRACE_UART);
+
+#if defined(DOWNLOAD)
+	/* before saying anything, for a host sending to find a quiet line */
+	if (download_requested())
+		download_mode();
+#endif
+	trace_mark(TRACE_PROBE);
 #ifdef DEBUG
 	char t[10];
 	itoa((int)bootopt, t, 16);
@@ -258,21 +909,53 @@ void main(void)
 #endif
 
 	rom_start = (unsigned int)&_rom_start;
-	rom_end = rom_start + (unsigned int)&_rom_size;
+	rom_end = (unsigned int)&_scratch; /* no image reaches the scratch sectors */
 
 	if (bootopt->addr != (uintptr_t)app &&
 			bootopt->addr >= rom_start && bootopt->addr < rom_end) {
 		img = (struct appimg_t *)bootopt->addr;
+#if defined(DELTA)
+		if (is_delta((const unsigned int *)img) &&
+				!memcmp(img->hash, bootopt->hash, HASH_SIZE) &&
+				apply_delta((const struct deltaimg_t *)img, app,
+					rom_end, &img))
+			goto out;
+#endif
 
 		if (img->magic[0] == MAGIC1 &&
 				img->magic[1] == MAGIC2 &&
 				img->magic[2] == MAGIC3 &&
+				!check_layout(img) &&
 				!memcmp(img->hash, bootopt->hash, HASH_SIZE) &&
-				!verify(img->hash, img->data, img->len, &_pubkey) &&
 				/* FIXME: Include meta and align by sector size */
 				(unsigned int)app + img->len < (unsigned int)img) {
-			notice("Program new image");
-			program(app, img, &_aeskey);
+			/* before anything of the current app is erased */
+			if (check_crc(img->crc, img->data, img->size)) {
+				reject(img);
+				freeze();
+			}
+			if (verify_staged(img, &_pubkey)) {
+				/* not authentic, so the current app stays,
+				 * BootOpt pointing back to it */
+				const struct bootopt_t installed = {
+					.addr = (uintptr_t)app,
+				};
+
+				reject(img);
+				if ((img = get_app_header(&installed,
+								rom_end)) == NULL)
+					boot_failed(app, rom_end);
+				update_bootopt(&_bootopt, app, img);
+				goto boot;
+			}
+			notice("Install new image");
+			if (install(app, img, &_pubkey, &_aeskey)) {
+				/* The current app is gone by now. Leave the
+				 * image for the next boot to try again, it is
+				 * programming that failed. */
+				freeze();
+			}
+			trace_mark(TRACE_INSTALL);
 			dsb();
 			isb();
 			update_bootopt(&_bootopt, app, img);
@@ -287,19 +970,24 @@ void main(void)
 		}
 	}
 
+boot:
 	if ((img = get_app_header(bootopt, rom_end)) == NULL)
-		freeze();
+		boot_failed(app, rom_end);
+	trace_mark(TRACE_HEADER);
 
 	if (img->len == bootopt->len &&
 			!memcmp(bootopt->hash, img->hash, HASH_SIZE) &&
-			!memcmp(bootopt->iv, img->iv, INITIAL_VECTOR_SIZE))
+			!memcmp(bootopt->iv, img->iv, INITIAL_VECTOR_SIZE) &&
+			!memcmp(bootopt->plain, img->plain, HASH_SIZE))
 		goto out;
 
 	warn("bootopt does not match to the current app!");
-	if (verify_enc(img->hash, (const uint8_t *)app, img->len,
-				&_pubkey, &_aeskey, img->iv))
-		freeze();
+	if (check_crc(img->plain_crc, app, img->len) ||
+			verify(img->plain, (const uint8_t *)app, img->len,
+				&_pubkey))
+		boot_failed(app, rom_end);
 	update_bootopt(&_bootopt, app, img);
+	bootcache_save(bootopt, &_aeskey);
 	/* NOTE: Do not reboot here but just run the app after updating
 	 * bootopt. Otherwise infinite rebooting may occur when it
 	 * reaches flash write endurance */
@@ -307,18 +995,35 @@ void main(void)
 
 out:
 #ifndef QUICKBOOT
-	if (verify_enc(bootopt->hash, (const uint8_t *)bootopt->addr,
-				bootopt->len, &_pubkey, &_aeskey, bootopt->iv)) {
-		warn("program may be modified");
-		freeze();
+	if (!bootcache_valid(bootopt, &_aeskey)) {
+		if (check_crc(img->plain_crc, (const void *)bootopt->addr,
+					bootopt->len) ||
+				verify(bootopt->plain,
+					(const uint8_t *)bootopt->addr,
+					bootopt->len, &_pubkey)) {
+			warn("program may be modified");
+			boot_failed(app, rom_end);
+		}
+		bootcache_save(bootopt, &_aeskey);
 	}
 #endif
+	trace_mark(TRACE_VERIFY);
 
 #ifdef DEBUG
 	uart_puts("Run     0x");
 	itoa((int)app, t, 16);
 	uart_puts(t);
 	uart_puts("\r\n\r\n");
+#endif
+	uart_deinit();
+	clock_deinit();
+	trace_mark(TRACE_JUMP);
+#if defined(ABSLOT) && defined(stm32f4)
+	if (app == (uint32_t *)&_slot_b)
+		run_swapped(app[1]);
+#endif
+#if defined(HOST)
+	emu_halt(EMU_HALT_RUN, app[1]);
 #endif
 	((void (*)())app[1])();
 }
@@ -22,6 +22,7 @@
 
 #include "bsp.h"
 #include "flash.h"
+#include "uart.h"
 
 extern char _ram_end;
 
@@ -83,4 +84,42 @@ __attribute__((section(".vector"), aligned(4), used)) = {
 	ISR_null,	/* 13     : 0x34  - Reserved */
 	ISR_null,	/* 14     : 0x38  - PendSV */
 	ISR_null,	/* 15     : 0x3c  - SysTick */
+	ISR_null,	/* 16     : 0x40  - IRQ 0 */
+	ISR_null,	/* 17     : 0x44  - IRQ 1 */
+	ISR_null,	/* 18     : 0x48  - IRQ 2 */
+	ISR_null,	/* 19     : 0x4c  - IRQ 3 */
+	ISR_flash,	/* 20     : 0x50  - IRQ 4, FLASH */
+	ISR_null,	/* 21     : 0x54  - IRQ 5 */
+	ISR_null,	/* 22     : 0x58  - IRQ 6 */
+	ISR_null,	/* 23     : 0x5c  - IRQ 7 */
+	ISR_null,	/* 24     : 0x60  - IRQ 8 */
+	ISR_null,	/* 25     : 0x64  - IRQ 9 */
+	ISR_null,	/* 26     : 0x68  - IRQ 10 */
+	ISR_null,	/* 27     : 0x6c  - IRQ 11 */
+	ISR_null,	/* 28     : 0x70  - IRQ 12 */
+	ISR_null,	/* 29     : 0x74  - IRQ 13 */
+	ISR_null,	/* 30     : 0x78  - IRQ 14 */
+	ISR_null,	/* 31     : 0x7c  - IRQ 15 */
+	ISR_null,	/* 32     : 0x80  - IRQ 16 */
+	ISR_null,	/* 33     : 0x84  - IRQ 17 */
+	ISR_null,	/* 34     : 0x88  - IRQ 18 */
+	ISR_null,	/* 35     : 0x8c  - IRQ 19 */
+	ISR_null,	/* 36     : 0x90  - IRQ 20 */
+	ISR_null,	/* 37     : 0x94  - IRQ 21 */
+	ISR_null,	/* 38     : 0x98  - IRQ 22 */
+	ISR_null,	/* 39     : 0x9c  - IRQ 23 */
+	ISR_null,	/* 40     : 0xa0  - IRQ 24 */
+	ISR_null,	/* 41     : 0xa4  - IRQ 25 */
+	ISR_null,	/* 42     : 0xa8  - IRQ 26 */
+	ISR_null,	/* 43     : 0xac  - IRQ 27 */
+	ISR_null,	/* 44     : 0xb0  - IRQ 28 */
+	ISR_null,	/* 45     : 0xb4  - IRQ 29 */
+	ISR_null,	/* 46     : 0xb8  - IRQ 30 */
+	ISR_null,	/* 47     : 0xbc  - IRQ 31 */
+	ISR_null,	/* 48     : 0xc0  - IRQ 32 */
+	ISR_null,	/* 49     : 0xc4  - IRQ 33 */
+	ISR_null,	/* 50     : 0xc8  - IRQ 34 */
+	ISR_null,	/* 51     : 0xcc  - IRQ 35 */
+	ISR_null,	/* 52     : 0xd0  - IRQ 36 */
+	ISR_usart1,	/* 53     : 0xd4  - IRQ 37, USART1 */
 };
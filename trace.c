@@ -0,0 +1,52 @@
+#include "bsp.h"
+#include "clock.h"
+#include "trace.h"
+
+#include <string.h>
+
+#if defined(TRACE)
+enum {
+	DEMCR_TRCENA		= 24,
+	DWT_CTRL_CYCCNTENA	= 0,
+};
+
+struct trace_block trace_block __attribute__((section(".trace"), used));
+
+_Static_assert(sizeof(trace_block) <= TRACE_BLOCK_SIZE,
+		"trace block overflows its reserved RAM");
+
+void trace_init(void)
+{
+	DEMCR |= 1U << DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= 1U << DWT_CTRL_CYCCNTENA;
+
+	memset(&trace_block, 0, sizeof(trace_block));
+	trace_block.magic = TRACE_MAGIC;
+	trace_mark(TRACE_START);
+}
+
+void trace_mark(enum trace_phase phase)
+{
+	struct trace_event *e;
+
+	if (trace_block.n >= TRACE_EVENTS)
+		return;
+
+	e = &trace_block.event[trace_block.n++];
+	e->cycles = DWT_CYCCNT;
+	e->phase = phase;
+	e->hz = clock_hclk();
+}
+
+uint32_t trace_begin(void)
+{
+	return DWT_CYCCNT;
+}
+
+void trace_end(enum trace_sum sum, uint32_t start)
+{
+	trace_block.sum[sum].cycles += DWT_CYCCNT - start;
+	trace_block.sum[sum].hz = clock_hclk();
+}
+#endif
@@ -0,0 +1,83 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* Boot timeline in DWT CYCCNT cycles, recorded into a block at the start of
+ * RAM, 0x20000000, that the bootloader leaves behind along with CYCCNT
+ * running. An application keeping its RAM clear of the first
+ * TRACE_BLOCK_SIZE bytes finds it there, `magic` telling if it is. Cycles
+ * are at `hz` of the event before, which changes with the clock. Sums are
+ * the cycles spent in each of the crypto primitives and flash operations
+ * over the boot. CYCCNT wraps around in 2^32 cycles, 25s at 168MHz. */
+
+#define TRACE_MAGIC			0x45435254U /* "TRCE" */
+#define TRACE_BLOCK_SIZE		256 /* _trace_size in common.ld */
+#define TRACE_EVENTS			12
+
+enum trace_phase {
+	TRACE_START = 1, /* CYCCNT zeroed */
+	TRACE_CLOCK, /* clock_init() */
+	TRACE_UART, /* uart_init() */
+	TRACE_PROBE, /* download_requested() */
+	TRACE_INSTALL, /* install() of a staged image */
+	TRACE_HEADER, /* get_app_header() */
+	TRACE_VERIFY, /* the app verified, or the boot cache found valid */
+	TRACE_JUMP, /* clocks restored, jumping to the app */
+};
+
+enum trace_sum {
+	TRACE_SHA,
+	TRACE_AES,
+	TRACE_SIG,
+	TRACE_FLASH,
+	TRACE_CRC,
+	TRACE_NSUMS,
+};
+
+struct trace_event {
+	uint32_t phase;
+	uint32_t cycles;
+	uint32_t hz; /* HCLK from here on */
+};
+
+struct trace_block {
+	uint32_t magic;
+	uint32_t n;
+	struct trace_event event[TRACE_EVENTS];
+	struct {
+		uint32_t cycles;
+		uint32_t hz;
+	} sum[TRACE_NSUMS];
+};
+
+#if defined(TRACE)
+extern struct trace_block trace_block;
+
+void trace_init(void);
+void trace_mark(enum trace_phase phase);
+uint32_t trace_begin(void);
+void trace_end(enum trace_sum sum, uint32_t start);
+#else
+static inline void trace_init(void)
+{
+}
+
+static inline void trace_mark(enum trace_phase phase)
+{
+	(void)phase;
+}
+
+static inline uint32_t trace_begin(void)
+{
+	return 0;
+}
+
+static inline void trace_end(enum trace_sum sum, uint32_t start)
+{
+	(void)sum;
+	(void)start;
+}
+#endif
+
+#endif /* __TRACE_H__ */
@@ -1,28 +1,136 @@
 #include "uart.h"
 #include "bsp.h"
+#include "clock.h"
+
+#include <stdint.h>
+
+#define BAUDRATE			115200UL
+
+#define __iap				__attribute__((section(".iap")))
+
+static struct {
+	uint8_t buf[UART_TXBUF];
+	volatile unsigned int head, tail;
+} tx;
+
+static struct {
+	uint8_t buf[UART_RXBUF];
+	volatile unsigned int head, tail;
+} rx;
+
+/* called with the USART interrupt masked or from the ISR itself */
+static void __iap service(void)
+{
+	unsigned int sr = USART1_SR;
+	uint8_t c;
+
+	if (sr & ((1 << USART_RXNE) | (1 << USART_ORE))) {
+		c = (uint8_t)USART1_DR;
+		if (rx.head - rx.tail < UART_RXBUF) /* dropped otherwise */
+			rx.buf[rx.head++ & (UART_RXBUF - 1)] = c;
+	}
+
+	if ((sr & (1 << USART_TXE)) && (USART1_CR1 & (1 << USART_TXEIE))) {
+		if (tx.head != tx.tail)
+			USART1_DR = tx.buf[tx.tail++ & (UART_TXBUF - 1)];
+		else
+			USART1_CR1 &= ~(1U << USART_TXEIE);
+	}
+}
+
+void ISR_usart1(void)
+{
+	service();
+}
+
+/* PRIMASK is left as it was, set all along as the flash idle hook */
+void __iap uart_poll(void)
+{
+	unsigned int primask = irq_save();
+
+	service();
+	irq_restore(primask);
+}
+
+int __iap uart_tryget(void)
+{
+	int c;
+
+	if (rx.head == rx.tail)
+		return -1;
+
+	c = rx.buf[rx.tail & (UART_RXBUF - 1)];
+	rx.tail++;
+
+	return c;
+}
 
 void uart_init()
 {
-	RCC_APB2ENR |= 1 << RCC_APB2ENR_IOPAEN; // gpioa clock enable
+	tx.head = tx.tail = 0;
+	rx.head = rx.tail = 0;
+
+#if defined(stm32f4)
+	RCC_AHBENR |= RCC_AHBENR_GPIOAEN; // gpioa clock enable
+	GPIOA_MODER = (GPIOA_MODER & ~(0xfUL << 18)) | (0xaUL << 18); // PA9, PA10: alternate function
+	GPIOA_AFRH = (GPIOA_AFRH & ~(0xffUL << 4)) | (0x77UL << 4); // AF7: usart1 tx, rx
+#else
+	RCC_APB2ENR |= RCC_APB2ENR_IOPAEN; // gpioa clock enable
 	GPIOA_CRH |= 0x0BUL << 4; // tx: out push-pull, PA9
 	GPIOA_CRH |= 0x04UL << 8; // rx: in floating, PA10
-	RCC_APB2ENR |= 1 << RCC_APB2ENR_USART1EN; // usart1 clock enable
-	USART1_BRR = 8000000L/115200L;
+#endif
+	RCC_APB2ENR |= RCC_APB2ENR_USART1EN; // usart1 clock enable
+	USART1_BRR = (clock_pclk2() + BAUDRATE / 2) / BAUDRATE;
 	USART1_CR1 |= (1 << USART_RE) | (1 << USART_TE); // tx, rx enable
+	USART1_CR1 |= 1 << USART_RXNEIE;
 	USART1_CR1 |= 1 << USART_UE; // usart enable
+
+	NVIC_ISER(USART1_IRQ / 32) = 1U << (USART1_IRQ % 32);
+	sei();
+}
+
+/* Leaves no interrupt behind for the application to take, enabled or
+ * pending, and PRIMASK clear as out of reset */
+void uart_deinit()
+{
+	uart_flush();
+
+	cli();
+	NVIC_ICER(USART1_IRQ / 32) = 1U << (USART1_IRQ % 32);
+	USART1_CR1 &= ~((1U << USART_RXNEIE) | (1U << USART_TXEIE));
+	NVIC_ICPR(USART1_IRQ / 32) = 1U << (USART1_IRQ % 32);
+	sei();
+}
+
+void uart_flush(void)
+{
+	while (tx.head != tx.tail)
+		uart_poll();
+	while (!(USART1_SR & (1 << USART_TC)));
 }
 
 int uart_put(int c)
 {
-	while (!(USART1_SR & (1 << USART_TXE)));
-	USART1_DR = c & 0xff;
+	while (tx.head - tx.tail >= UART_TXBUF)
+		uart_poll();
+
+	tx.buf[tx.head & (UART_TXBUF - 1)] = (uint8_t)c;
+	cli();
+	tx.head++;
+	USART1_CR1 |= 1 << USART_TXEIE;
+	sei();
+
 	return c;
 }
 
 int uart_get()
 {
-	while (!(USART1_SR & (1 << USART_RXNE)));
-	return (int)(USART1_DR & 0xff);
+	int c;
+
+	while ((c = uart_tryget()) < 0)
+		uart_poll();
+
+	return c;
 }
 
 void uart_puts(const char *s)
@@ -4,19 +4,36 @@
 enum {
 	USART_RE = 2,
 	USART_TE = 3,
+	USART_RXNEIE = 5,
+	USART_TXEIE = 7,
 	USART_UE = 13,
+	USART_ORE = 3, /* SR */
 	USART_RXNE = 5, /* SR */
+	USART_TC = 6, /* SR */
 	USART_TXE = 7, /* SR */
 };
 
-enum {
-	RCC_APB2ENR_IOPAEN	= 2,
-	RCC_APB2ENR_USART1EN	= 14,
-};
+#define USART1_IRQ		37
+
+#define UART_TXBUF		256 /* power of 2 */
+#define UART_RXBUF		256 /* power of 2 */
 
+/* TX and RX go through ring buffers, drained and filled by ISR_usart1, so
+ * that output overlaps with whatever comes next. The ISR must not be taken
+ * while the flash is busy, as the core would stall fetching its vector from
+ * the flash with nothing draining the USART, so flash.c keeps interrupts
+ * masked meanwhile and uart_poll(), in .iap, services it from the flash
+ * idle hook instead. */
 void uart_init();
+void uart_deinit();
 int uart_put(int c);
 int uart_get();
 void uart_puts(const char *s);
+/* -1 if nothing received */
+int uart_tryget(void);
+void uart_poll(void);
+/* Waits until all the bytes are out on the line */
+void uart_flush(void);
+void ISR_usart1(void);
 
 #endif